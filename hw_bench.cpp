@@ -0,0 +1,405 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include "util.hpp"
+#include "util_hw.hpp"
+#include "util_crc.hpp"
+#include "util_rsa.hpp"
+#include "util_gen.hpp"
+#include "util_io.hpp"
+
+// Bumped when a key of the JSON output changes meaning
+constexpr int BENCH_FORMAT = 2;
+
+struct bench_result {
+    std::string name;
+    uint64_t bytes; // Per iteration, 0 - no throughput
+    std::vector<uint64_t> ns;
+    uint64_t peak_rss_kb;
+};
+
+// Peak RSS of the process, reset between benchmarks through clear_refs
+static void
+PeakRSSReset()
+{
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+static uint64_t
+PeakRSSKb()
+{
+    std::ifstream status("/proc/self/status");
+
+    for (std::string line; std::getline(status, line);) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+
+    return 0;
+}
+
+static void
+BenchParse(Firmware &fw, const std::string &item_list)
+{
+    std::stringstream list_metadata(item_list);
+
+    fw.ReadHeaderFromFS(list_metadata);
+
+    for (std::string line; std::getline(list_metadata, line);) {
+
+        if (line.size() <= 2 || line.front() != '+') {
+            continue;
+        }
+
+        line.erase(0, 2);
+
+        struct huawei_item hi = {};
+        fw.PresetItemHeader(hi, line);
+        fw.AddItemHeader(hi);
+    }
+}
+
+// setup() runs before every iteration and is not timed
+static void
+BenchRun(std::vector<struct bench_result> &results,
+         const std::string &name,
+         uint64_t bytes,
+         size_t iterations,
+         const std::function<void()> &setup,
+         const std::function<void()> &fn)
+{
+    using clock = std::chrono::steady_clock;
+
+    struct bench_result r = { name, bytes, {}, 0 };
+
+    PeakRSSReset();
+
+    for (size_t i = 0; i < iterations; ++i) {
+        if (setup) {
+            setup();
+        }
+
+        auto t_start = clock::now();
+        fn();
+        auto t_end = clock::now();
+
+        r.ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start)
+                           .count());
+    }
+
+    r.peak_rss_kb = PeakRSSKb();
+
+    std::cerr << "[ * ] " << std::left << std::setw(24) << name << std::right
+              << *std::min_element(r.ns.begin(), r.ns.end()) / 1000 << " us" << std::endl;
+
+    results.push_back(std::move(r));
+}
+
+// Nearest-rank percentile of sorted samples
+static uint64_t
+Percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+
+    return sorted.at(std::min(std::max(rank, size_t(1)), sorted.size()) - 1);
+}
+
+static void
+BenchWriteJson(std::ostream &os,
+               const std::vector<struct bench_result> &results,
+               uint64_t image_sz,
+               size_t item_counts,
+               size_t iterations,
+               size_t threads,
+               int rsa_bits)
+{
+    os << "{\n  \"format\": " << BENCH_FORMAT << ",\n  \"config\": {";
+    os << "\"image_size\": " << image_sz << ", ";
+    os << "\"items\": " << item_counts << ", ";
+    os << "\"iterations\": " << iterations << ", ";
+    os << "\"threads\": " << threads << ", ";
+    os << "\"rsa_bits\": " << rsa_bits << ", ";
+    os << "\"crc32_impl\": \"" << crc32_impl_name(crc32_impl_get()) << "\", ";
+    os << "\"io_backend\": \"" << io_backend_name(io_backend_get()) << "\"},\n";
+    os << "  \"benchmarks\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &r     = results.at(i);
+        auto sorted = r.ns;
+
+        std::sort(sorted.begin(), sorted.end());
+
+        // Throughput at the median latency
+        uint64_t p50 = Percentile(sorted, 50);
+        double mb_s  = r.bytes && p50 ? r.bytes * 1e3 / p50 : 0;
+
+        os << (i ? "," : "") << "\n    {";
+        os << "\"name\": \"" << JsonEscape(r.name) << "\", ";
+        os << "\"iterations\": " << sorted.size() << ", ";
+        os << "\"bytes\": " << r.bytes << ", ";
+        os << "\"mb_s\": " << std::fixed << std::setprecision(1) << mb_s << ", ";
+        os << "\"ns\": {\"min\": " << sorted.front() << ", \"p50\": " << p50
+           << ", \"p90\": " << Percentile(sorted, 90) << ", \"p99\": " << Percentile(sorted, 99)
+           << ", \"max\": " << sorted.back() << "}, ";
+        os << "\"peak_rss_kb\": " << r.peak_rss_kb << "}";
+    }
+
+    os << "\n  ]\n}\n";
+}
+
+int
+main(int argc, char *argv[])
+{
+    auto usage_print = [&]() {
+        usage(
+            {
+                argv[0],
+                "-d /path/to/scratch",
+                "[-s image_size_mib]",
+                "[-n items]",
+                "[-i iterations]",
+                "[-k rsa_bits]",
+                "[-o bench.json]",
+                "[-j threads]",
+            },
+            {
+                "-d Scratch directory for the synthetic tree and image",
+                "-s Size of the synthetic image in MiB (Default: 64)",
+                "-n Count of items (Default: 8)",
+                "-i Iterations of each benchmark (Default: 5)",
+                "-k Size of the generated RSA key (Default: 2048)",
+                "-o Path to save results as JSON (Default: stdout)",
+                "-j Worker threads (Default: all cores)",
+            });
+    };
+
+    std::string path_scratch, path_json;
+
+    uint64_t image_sz  = 64;
+    size_t item_counts = 8, iterations = 5, threads = 0;
+    int rsa_bits = 2048;
+
+    for (int opt; (opt = getopt(argc, argv, "d:s:n:i:k:o:j:")) != -1;) {
+        switch (opt) {
+            case 'd':
+                path_scratch = optarg;
+                break;
+            case 's':
+                image_sz = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 'n':
+                item_counts = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'i':
+                iterations = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'k':
+                rsa_bits = std::atoi(optarg);
+                break;
+            case 'o':
+                path_json = optarg;
+                break;
+            case 'j':
+                threads = std::strtoul(optarg, nullptr, 10);
+                break;
+        }
+    }
+
+    if (path_scratch.empty() || !image_sz || !item_counts || !iterations || rsa_bits < 1024) {
+        usage_print();
+    }
+
+    image_sz <<= 20;
+
+    try {
+
+        auto path_items  = FilePathOnFS(path_scratch, "/items");
+        auto path_unpack = FilePathOnFS(path_scratch, "/unpack");
+        auto path_fmw    = FilePathOnFS(path_scratch, "/bench.bin");
+
+        std::filesystem::create_directories(path_items);
+        std::filesystem::create_directories(path_unpack);
+
+        struct gen_spec spec = {};
+        spec.item_counts     = item_counts;
+        spec.item_sz_max     = image_sz / item_counts;
+        spec.dist            = GEN_FIXED;
+        spec.sections        = { "BENCH" };
+        spec.prod_list_sz    = 28;
+        spec.threads         = threads;
+
+        std::cerr << "[ * ] Synthetic tree: " << path_items << std::endl;
+        auto item_list = GenTree(spec, path_items);
+
+        std::vector<struct bench_result> results;
+        Firmware fw = {};
+        fw.SetThreads(threads);
+
+        // Small operations run more often for usable percentiles
+        size_t iterations_small = iterations * 100;
+
+        BenchRun(results, "parse_item_list", item_list.size(), iterations_small, nullptr, [&] {
+            Firmware fw_parse = {};
+            BenchParse(fw_parse, item_list);
+        });
+
+        BenchRun(
+            results,
+            "read_item_pack_mem",
+            image_sz,
+            iterations,
+            [&] {
+                fw.Reset();
+                BenchParse(fw, item_list);
+            },
+            [&] {
+                fw.ReadItemFromFS(path_items);
+                fw.PackToMem();
+            });
+
+        uint64_t fmw_sz = 0;
+
+        BenchRun(results, "write_flash", image_sz, iterations, nullptr, [&] {
+            fw.WriteFlashToFS(path_fmw);
+            fmw_sz = fw.FlashSize();
+        });
+
+        // Parsing maps the image, the bytes come in as pages are touched: every page
+        // is, so the MB/s is over what was read (from page cache, just written)
+        BenchRun(results, "read_flash", fmw_sz, iterations, nullptr, [&] {
+            fw.ReadFlashFromFS(path_fmw);
+            fw.PrefetchFlash();
+        });
+
+        BenchRun(
+            results,
+            "unpack",
+            fmw_sz,
+            iterations,
+            [&] { fw.ReadFlashFromFS(path_fmw); },
+            [&] {
+                fw.UnpackToFS(path_unpack,
+                              FilePathOnFS(path_unpack, "/item_list.txt"),
+                              FilePathOnFS(path_unpack, "/sig_item_list.txt"),
+                              FilePathOnFS(path_unpack, "/item_stat.txt"));
+            });
+
+        // Unpack and a pack that re-reads every item, per I/O backend. The gap
+        // shows with many small items (-n 4096 -s 16).
+        auto io_default     = io_backend_get();
+        auto path_pack      = FilePathOnFS(path_scratch, "/pack.bin");
+        auto path_pack_stat = FilePathOnFS(path_scratch, "/pack_stat.txt");
+
+        Firmware fw_pack = {};
+        fw_pack.SetThreads(threads);
+
+        for (int i = 0; i < IO_BACKEND_MAX; ++i) {
+            auto backend = static_cast<enum IO_BACKEND>(i);
+
+            if (!io_backend_supported(backend)) {
+                continue;
+            }
+
+            io_backend_set(backend);
+
+            BenchRun(
+                results,
+                std::string("unpack_io_") + io_backend_name(backend),
+                fmw_sz,
+                iterations,
+                [&] { fw.ReadFlashFromFS(path_fmw); },
+                [&] {
+                    fw.UnpackToFS(path_unpack,
+                                  FilePathOnFS(path_unpack, "/item_list.txt"),
+                                  FilePathOnFS(path_unpack, "/sig_item_list.txt"),
+                                  FilePathOnFS(path_unpack, "/item_stat.txt"));
+                });
+
+            BenchRun(
+                results,
+                std::string("pack_io_") + io_backend_name(backend),
+                image_sz,
+                iterations,
+                [&] {
+                    fw_pack.Reset();
+                    BenchParse(fw_pack, item_list);
+                    std::filesystem::remove(path_pack_stat);
+                },
+                [&] { fw_pack.PackToFS(path_items, path_pack, path_pack_stat); });
+        }
+
+        io_backend_set(io_default);
+
+        // Everything below works on the mapped image, kept in page cache
+        fw.ReadFlashFromFS(path_fmw);
+        fw.PrefetchFlash();
+
+        auto &fmw = fw.getFlashMap();
+
+        BenchRun(results, "calculate_crc32", fmw_sz, iterations, nullptr, [&] {
+            fw.CalculateCRC32();
+        });
+
+        for (int i = 0; i < CRC32_IMPL_MAX; ++i) {
+            auto impl = static_cast<enum CRC32_IMPL>(i);
+
+            if (!crc32_impl_supported(impl)) {
+                continue;
+            }
+
+            BenchRun(results,
+                     std::string("crc32_") + crc32_impl_name(impl),
+                     fmw_sz,
+                     iterations,
+                     nullptr,
+                     [&] { crc32_update(impl, 0, fmw.data(), fmw.size()); });
+        }
+
+        BenchRun(results, "sha256_sum", fmw_sz, iterations, nullptr, [&] {
+            sha256_sum(fmw.data(), fmw.size());
+        });
+
+        // Signature over a sig_item_list sized message, as hw_sign does
+        auto key_pem = RSA_generate_pem(rsa_bits);
+        RSAKeyring key_priv(RSA_KEY::PRIVATE, key_pem.first);
+        RSAKeyring key_pub(RSA_KEY::PUBLIC, key_pem.second);
+
+        std::string sig_data(4096, '\0');
+        GenFill(sig_data, item_counts, 0);
+
+        std::string sig;
+
+        BenchRun(results, "rsa_sign", sig_data.size(), iterations_small / 10, nullptr, [&] {
+            sig = key_priv.Sign(sig_data.data(), sig_data.size());
+        });
+
+        struct rsa_sig_pair pair = { reinterpret_cast<const uint8_t *>(sig_data.data()),
+                                     sig_data.size(),
+                                     reinterpret_cast<const uint8_t *>(sig.data()),
+                                     sig.size() };
+
+        BenchRun(results, "rsa_verify", sig_data.size(), iterations_small, nullptr, [&] {
+            if (!key_pub.Verify(pair)) {
+                throw_err("!Verify()", "rsa_verify");
+            }
+        });
+
+        if (path_json.empty()) {
+            BenchWriteJson(std::cout, results, fmw_sz, item_counts, iterations, threads, rsa_bits);
+        } else {
+            std::fstream json = FileOpen(path_json, std::ios::out);
+            BenchWriteJson(json, results, fmw_sz, item_counts, iterations, threads, rsa_bits);
+
+            std::cout << "[ * ] Path to results: " << path_json << std::endl;
+        }
+
+    } catch (const std::exception &e) {
+        std::cerr << "[ - ] Error: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
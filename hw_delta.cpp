@@ -0,0 +1,104 @@
+#include <iomanip>
+#include <sstream>
+#include "util.hpp"
+#include "util_hw.hpp"
+#include "util_delta.hpp"
+
+int
+main(int argc, char *argv[])
+{
+    auto usage_print = [&]() {
+        usage(
+            {
+                argv[0],
+                "-f old_firmware.bin",
+                "[-m -n new_firmware.bin -o firmware.delta [-b block_size]]",
+                "[-a -i firmware.delta -o new_firmware.bin]",
+            },
+            {
+                "-f Path from old firmware.bin",
+                "-m Make delta from old to new (With -n)",
+                "-a Apply delta to old (With -i)",
+                "-n Path from new firmware.bin",
+                "-i Path from delta",
+                "-o Path to save (delta|new firmware.bin)",
+                "-b Block size of the binary diff (Default: 4096)",
+            });
+    };
+
+    std::string path_old, path_new, path_delta, path_out;
+
+    bool fmake = false, fapply = false;
+    uint32_t block_sz = 4096;
+
+    for (int opt; (opt = getopt(argc, argv, "f:man:i:o:b:")) != -1;) {
+        switch (opt) {
+            case 'f':
+                path_old = optarg;
+                break;
+            case 'm':
+                fmake = true;
+                break;
+            case 'a':
+                fapply = true;
+                break;
+            case 'n':
+                path_new = optarg;
+                break;
+            case 'i':
+                path_delta = optarg;
+                break;
+            case 'o':
+                path_out = optarg;
+                break;
+            case 'b':
+                block_sz = std::strtoul(optarg, nullptr, 10);
+                break;
+        }
+    }
+
+    if ((fmake & fapply) | (!fmake & !fapply) | (fmake & path_new.empty()) |
+        (fapply & path_delta.empty()) | !block_sz) {
+        usage_print();
+    }
+
+    if (path_old.empty() || path_out.empty()) {
+        usage_print();
+    }
+
+    try {
+
+        if (fmake) {
+
+            std::fstream delta = FileOpen(path_out, std::ios::out | std::ios::binary);
+            auto stats         = DeltaMake(path_old, path_new, delta, block_sz);
+
+            std::cout << "[ * ] Items by reference: " << stats.items_ref << std::endl;
+            std::cout << "[ * ] Items diffed:       " << stats.items_diff << std::endl;
+            std::cout << "[ * ] Copied from old:    " << stats.copy_sz << std::endl;
+            std::cout << "[ * ] Literal bytes:      " << stats.literal_sz << std::endl;
+            std::cout << "[ * ] Delta size:         " << delta.tellp() << std::endl;
+
+        } else {
+
+            std::fstream delta = FileOpen(path_delta, std::ios::in | std::ios::binary);
+            auto report        = DeltaApply(path_old, delta, path_out);
+
+            std::cout << "[ + ] Rebuilt bit for bit: " << path_out << std::endl;
+            std::cout << (report.raw_ok ? "[ + ] " : "[ - ] ") << "Verify CRC32 Full"
+                      << std::endl;
+            std::cout << (report.hdr_ok ? "[ + ] " : "[ - ] ") << "Verify CRC32 Head"
+                      << std::endl;
+
+            auto items_bad = std::count(report.items_ok.begin(), report.items_ok.end(), false);
+
+            std::cout << (items_bad ? "[ - ] " : "[ + ] ") << "Verify CRC32 Items, bad: "
+                      << items_bad << std::endl;
+        }
+
+    } catch (const std::exception &e) {
+        std::cerr << "[ - ] Error: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
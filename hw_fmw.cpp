@@ -1,7 +1,199 @@
+#include <set>
+#include <chrono>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <getopt.h>
 #include "util.hpp"
 #include "util_hw.hpp"
+#include "util_crc.hpp"
+
+enum BATCH_OP { UNPACK, CHECK, REPACK };
+
+struct batch_result {
+    std::string path_fmw;
+    std::string path_out;
+    std::string status;
+    std::string error;
+
+    size_t fmw_sz;
+    size_t item_counts;
+    size_t items_bad;
+    bool raw_ok;
+    bool hdr_ok;
+
+    double read_ms;
+    double work_ms;
+};
+
+static std::vector<std::string>
+BatchImages(const std::string &path_batch)
+{
+    std::vector<std::string> images;
+
+    if (std::filesystem::is_directory(path_batch)) {
+        for (auto &e : std::filesystem::directory_iterator(path_batch)) {
+            if (e.is_regular_file() && e.path().extension() == ".bin") {
+                images.push_back(e.path().string());
+            }
+        }
+
+        std::sort(images.begin(), images.end());
+    } else {
+        std::stringstream list;
+        list << FileRead(path_batch, std::ios::in);
+
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty() && line.front() != '#') {
+                images.push_back(line);
+            }
+        }
+    }
+
+    if (images.empty()) {
+        throw_err("Empty batch", path_batch);
+    }
+
+    return images;
+}
+
+static void
+BatchRun(enum BATCH_OP op,
+         const std::string &path_batch,
+         const std::string &path_out,
+         size_t threads,
+         size_t readers,
+         bool fail_fast,
+         const std::string &path_store)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto images = BatchImages(path_batch);
+
+    std::filesystem::create_directories(path_out);
+
+    // Output per image is named after it, made unique for list files
+    std::vector<std::string> names;
+    std::set<std::string> names_used;
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        auto name = std::filesystem::path(images.at(i)).stem().string();
+
+        if (!names_used.insert(name).second) {
+            name += '_' + std::to_string(i);
+            names_used.insert(name);
+        }
+
+        names.push_back(name);
+    }
+
+    // One pipeline per worker, each one single threaded
+    size_t workers = ParallelWorkers(images.size(), threads);
+    std::vector<Firmware> pipelines(workers);
+
+    for (auto &fw : pipelines) {
+        fw.SetThreads(1);
+        fw.SetCRC32FailFast(fail_fast);
+
+        if (!path_store.empty()) {
+            fw.SetItemStore(path_store);
+        }
+    }
+
+    // Bounds how many images are read from disk at the same time
+    Semaphore disk_readers(readers ? readers : workers);
+
+    std::vector<struct batch_result> results(images.size());
+
+    ParallelFor(images.size(), workers, [&](size_t i, size_t w) {
+        auto &fw = pipelines.at(w);
+        auto &r  = results.at(i);
+
+        r.path_fmw = images.at(i);
+
+        try {
+            clock::time_point t_read;
+            {
+                std::lock_guard<Semaphore> lock(disk_readers);
+
+                t_read   = clock::now();
+                r.fmw_sz = std::filesystem::file_size(r.path_fmw);
+                fw.ReadFlashFromFS(r.path_fmw);
+                fw.PrefetchFlash();
+            }
+            auto t_work = clock::now();
+
+            r.item_counts = fw.getItemsHeader().size();
+
+            if (op == BATCH_OP::UNPACK) {
+                r.path_out = FilePathOnFS(path_out, names.at(i));
+
+                fw.UnpackToFS(r.path_out,
+                              FilePathOnFS(r.path_out, "/item_list.txt"),
+                              FilePathOnFS(r.path_out, "/sig_item_list.txt"),
+                              FilePathOnFS(r.path_out, "/item_stat.txt"));
+            }
+
+            auto crc = fw.VerifyCRC32();
+
+            r.raw_ok    = crc.raw_ok;
+            r.hdr_ok    = crc.hdr_ok;
+            r.items_bad = std::count(crc.items_ok.begin(), crc.items_ok.end(), false);
+
+            if (op == BATCH_OP::REPACK) {
+                r.path_out = FilePathOnFS(path_out, names.at(i) + ".bin");
+
+                fw.PackToMem();
+                fw.WriteFlashToFS(r.path_out);
+            }
+
+            r.status = (r.raw_ok && r.hdr_ok && !r.items_bad) ? "ok" : "crc_mismatch";
+
+            r.read_ms = std::chrono::duration<double, std::milli>(t_work - t_read).count();
+            r.work_ms = std::chrono::duration<double, std::milli>(clock::now() - t_work)
+                            .count();
+        } catch (const std::exception &e) {
+            r.status = "error";
+            r.error  = e.what();
+        }
+
+        // Drop the mapping before the next image
+        fw.Reset();
+    });
+
+    const char *op_name[] = { "unpack", "check", "repack" };
+    auto path_summary     = FilePathOnFS(path_out, "/summary.json");
+
+    std::fstream summary = FileOpen(path_summary, std::ios::out);
+    summary << std::fixed << std::setprecision(3);
+    summary << "{\n  \"op\": \"" << op_name[op] << "\",\n  \"images\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto &r = results.at(i);
+
+        summary << (i ? "," : "") << "\n    {";
+        summary << "\"path\": \"" << JsonEscape(r.path_fmw) << "\", ";
+        summary << "\"output\": \"" << JsonEscape(r.path_out) << "\", ";
+        summary << "\"status\": \"" << r.status << "\", ";
+        summary << "\"error\": \"" << JsonEscape(r.error) << "\", ";
+        summary << "\"size\": " << r.fmw_sz << ", ";
+        summary << "\"items\": " << r.item_counts << ", ";
+        summary << "\"crc32\": {\"full\": " << (r.raw_ok ? "true" : "false")
+                << ", \"head\": " << (r.hdr_ok ? "true" : "false")
+                << ", \"items_bad\": " << r.items_bad << "}, ";
+        summary << "\"time_ms\": {\"read\": " << r.read_ms << ", \"process\": "
+                << r.work_ms << "}}";
+
+        std::cout << (r.status == "ok" ? "[ + ] " : "[ - ] ") << r.status << ": "
+                  << r.path_fmw << (r.error.empty() ? "" : " - " + r.error) << std::endl;
+    }
+
+    summary << "\n  ]\n}\n";
+
+    std::cout << "[ * ] Path to summary: " << path_summary << std::endl;
+}
 
 int
 main(int argc, char *argv[])
@@ -11,27 +203,73 @@ main(int argc, char *argv[])
             {
                 argv[0],
                 "-d /path/items",
-                "[-u -f firmware.bin]",
-                "[-p -o firmware.bin]",
+                "[-u -f firmware.bin [-c] [-k] [-m] [-i item]... [-S section]... [-O] [-z]]",
+                "[-p -o firmware.bin [-m]]",
+                "[-b images [-u|-t|-p] [-r readers]]",
+                "[-s store [-g]]",
+                "[-j threads]",
                 "[-v]",
+                "[--stats[=json]]",
             },
             {
                 "-d Path (from|to) unpacked files",
                 "-u Unpack (With -f)",
                 "-p Pack (With -o)",
                 "-f Path from firmware.bin",
+                "-c Stop at the first CRC32 mismatch (With -u)",
+                "-k Copy items in the kernel, reflinks where the FS has them (With -u)",
+                "-i Unpack only items matching a name or glob, repeatable (With -u)",
+                "-S Unpack only items of a section name or glob, repeatable (With -u)",
+                "-O Write the one matching item to stdout, no -d needed (With -i/-S)",
+                "-z Inflate gzip/zlib items to item.inflated, or to stdout (With -u/-O)",
                 "-o Path to save firmware.bin",
+                "-m Also write item_list.bin (With -u), take the picked items from it (With -p)",
+                "-b Batch over a directory of *.bin or a list file, output to -d",
+                "-t Check CRC32 only (With -b)",
+                "-r Images read from disk at the same time (With -b)",
+                "-s Content-addressed store, unpack reflinks or hardlinks items from it",
+                "-g Remove blobs of the store no tree hardlinks to (With -s)",
+                "-j Worker threads (Default: all cores)",
                 "-v Verbose",
+                "--stats Print time, bytes and MB/s per phase to stderr (=json: as JSON)",
             });
     };
 
-    std::string path_fmw, path_items, path_metadata, path_sig_item;
+    std::string path_fmw, path_items, path_metadata, path_sig_item, path_item_stat;
+    std::string path_manifest;
+    std::string path_batch;
+    std::string path_store;
+
+    bool funpack = false, fpack = false, fverbose = false, ffail_fast = false;
+    bool fin = false, fout = false, fcheck = false, fgc = false;
+    bool fstats_json = false, fstdout = false, finflate = false, fkernel_copy = false;
+    bool fmanifest = false;
+    size_t threads = 0, readers = 0;
 
-    bool funpack = false, fpack = false, fverbose = false;
-    bool fin = false, fout = false;
+    struct item_filter filter;
 
-    for (int opt; (opt = getopt(argc, argv, "d:uf:po:v")) != -1;) {
+    const struct option long_opts[] = {
+        { "stats", optional_argument, nullptr, OPT_STATS },
+        { "item", required_argument, nullptr, 'i' },
+        { "section", required_argument, nullptr, 'S' },
+        { "stdout", no_argument, nullptr, 'O' },
+        { "inflate", no_argument, nullptr, 'z' },
+        { "kernel-copy", no_argument, nullptr, 'k' },
+        { "manifest", no_argument, nullptr, 'm' },
+        { nullptr, 0, nullptr, 0 },
+    };
+
+    const char *short_opts = "d:uf:cpo:b:tr:s:gj:vi:S:Ozkm";
+
+    for (int opt; (opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1;) {
         switch (opt) {
+            case OPT_STATS:
+                if (optarg && std::strcmp(optarg, "json")) {
+                    usage_print();
+                }
+                fstats_json = optarg;
+                StatsEnable();
+                break;
             case 'd':
                 path_items = optarg;
                 break;
@@ -52,7 +290,165 @@ main(int argc, char *argv[])
             case 'u':
                 funpack = true;
                 break;
+            case 'c':
+                ffail_fast = true;
+                break;
+            case 'j':
+                threads = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'b':
+                path_batch = optarg;
+                break;
+            case 't':
+                fcheck = true;
+                break;
+            case 'r':
+                readers = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                path_store = optarg;
+                break;
+            case 'g':
+                fgc = true;
+                break;
+            case 'i':
+                filter.items.push_back(optarg);
+                break;
+            case 'S':
+                filter.sections.push_back(optarg);
+                break;
+            case 'O':
+                fstdout = true;
+                break;
+            case 'z':
+                finflate = true;
+                break;
+            case 'k':
+                fkernel_copy = true;
+                break;
+            case 'm':
+                fmanifest = true;
+                break;
+        }
+    }
+
+    auto stats_print = [&]() {
+        if (StatsEnabled()) {
+            StatsPrint(std::cerr, fstats_json);
+        }
+    };
+
+    if (fgc) {
+        if (path_store.empty()) {
+            usage_print();
+        }
+
+        try {
+            auto gc = ItemStore(path_store).GC();
+
+            std::cout << "[ * ] Store blobs removed: " << gc.blobs << " (" << gc.bytes
+                      << " bytes)" << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << "[ - ] Error: " << e.what() << std::endl;
+        }
+
+        stats_print();
+        return 0;
+    }
+
+    if (!path_batch.empty()) {
+        if (fin | fout | fstdout | finflate | fkernel_copy | fmanifest | !filter.Empty() |
+            (funpack + fpack + fcheck != 1) | path_items.empty()) {
+            usage_print();
+        }
+
+        auto op = funpack ? BATCH_OP::UNPACK : fpack ? BATCH_OP::REPACK : BATCH_OP::CHECK;
+
+        try {
+            BatchRun(op, path_batch, path_items, threads, readers, ffail_fast, path_store);
+        } catch (const std::exception &e) {
+            std::cerr << "[ - ] Error: " << e.what() << std::endl;
+        }
+
+        stats_print();
+        return 0;
+    }
+
+    if (fcheck) {
+        usage_print();
+    }
+
+    if (fstdout) {
+        if (!fin | fout | fpack | fkernel_copy | fmanifest | filter.Empty() |
+            !path_store.empty()) {
+            usage_print();
+        }
+
+        // Piped into other tools: the exit status is all they see of an error
+        int ret = 0;
+
+        try {
+            Firmware firmware = {};
+            firmware.SetThreads(threads);
+            firmware.SetItemFilter(filter);
+            firmware.ReadFlashFromFS(path_fmw);
+
+            auto selected = firmware.ItemsSelected();
+
+            if (selected.size() != 1) {
+                throw_err("Filter must match one item", std::to_string(selected.size()));
+            }
+
+            auto &hi     = firmware.getItemsHeader().at(selected.front());
+            auto payload = firmware.ItemLoad(selected.front());
+
+            // Nothing reaches stdout unless the payload is intact
+            if (crc32_update(0, payload.raw.data(), payload.raw.size()) != hi.item_crc32) {
+                throw_err("CRC32 mismatch", hi.item);
+            }
+
+            if (finflate) {
+                auto format = zip_detect(payload.raw);
+
+                if (format == ZIP_NONE) {
+                    throw_err("Not gzip/zlib", hi.item);
+                }
+
+                // An intact item can still hold a broken stream: inflated once with
+                // no output to check it, so stdout never gets a partial item, then
+                // again to stdout. Twice the CPU, memory stays one chunk.
+                if (!zip_inflate(payload.raw, format).ok) {
+                    throw_err("Broken stream", hi.item);
+                }
+
+                zip_inflate(payload.raw, format, [](std::string_view chunk) {
+                    std::cout.write(chunk.data(), chunk.size());
+                });
+            } else {
+                std::cout.write(payload.raw.data(), payload.raw.size());
+            }
+
+            std::cout.flush();
+
+            if (!std::cout) {
+                throw_err("write()", "stdout");
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "[ - ] Error: " << e.what() << std::endl;
+            ret = 1;
         }
+
+        stats_print();
+        return ret;
+    }
+
+    if ((!filter.Empty() | finflate | fkernel_copy) & !funpack) {
+        usage_print();
+    }
+
+    // Store blobs are hashed in user space, nothing to gain
+    if (fkernel_copy & !path_store.empty()) {
+        usage_print();
     }
 
     if ((fpack & funpack) | (!fpack & !funpack) | (funpack & fout) | (fpack & fin)) {
@@ -63,17 +459,33 @@ main(int argc, char *argv[])
         usage_print();
     }
 
-    path_metadata = FilePathOnFS(path_items, "/item_list.txt");
-    path_sig_item = FilePathOnFS(path_items, "/sig_item_list.txt");
+    path_metadata  = FilePathOnFS(path_items, "/item_list.txt");
+    path_sig_item  = FilePathOnFS(path_items, "/sig_item_list.txt");
+    path_item_stat = FilePathOnFS(path_items, "/item_stat.txt");
+    path_manifest  = FilePathOnFS(path_items, "/item_list.bin");
 
     try {
 
         Firmware firmware = {};
+        firmware.SetThreads(threads);
+        firmware.SetCRC32FailFast(ffail_fast);
+
+        if (!path_store.empty()) {
+            firmware.SetItemStore(path_store);
+        }
 
         if (funpack) {
 
+            firmware.SetItemFilter(filter);
+            firmware.SetInflate(finflate);
+            firmware.SetKernelCopy(fkernel_copy);
+
+            if (fmanifest) {
+                firmware.SetManifest(path_manifest);
+            }
+
             firmware.ReadFlashFromFS(path_fmw);
-            firmware.UnpackToFS(path_items, path_metadata, path_sig_item);
+            firmware.UnpackToFS(path_items, path_metadata, path_sig_item, path_item_stat);
 
             firmware.PrintHeader();
             firmware.PrintItems(fverbose);
@@ -87,6 +499,8 @@ main(int argc, char *argv[])
 
             firmware.ReadHeaderFromFS(list_metadata);
 
+            std::vector<struct huawei_item> items_sel;
+
             for (std::string line; std::getline(list_metadata, line);) {
 
                 if (line.size() <= 2 || line.front() != '+') {
@@ -97,28 +511,34 @@ main(int argc, char *argv[])
 
                 struct huawei_item hi = {};
                 firmware.PresetItemHeader(hi, line);
-                firmware.AddItemHeader(hi);
+                items_sel.push_back(hi);
             };
 
+            // item_list.txt picks the items either way, -m takes their entries as unpacked
+            if (fmanifest) {
+                firmware.ReadManifestFromFS(path_manifest, items_sel);
+            } else {
+                for (auto &hi : items_sel) {
+                    firmware.AddItemHeader(hi);
+                }
+            }
+
             if (firmware.getItemsHeader().empty()) {
                 throw_err("Empty items on header", "Count of items");
             }
 
-            firmware.ReadItemFromFS(path_items);
-            firmware.PackToMem();
+            // Save
+            firmware.PackToFS(path_items, path_fmw, path_item_stat);
 
             firmware.PrintHeader();
             firmware.PrintItems(fverbose);
-
-            // Save
-            std::fstream fmw_bin =
-                FileOpen(path_fmw, std::ios_base::out | std::ios::binary);
-            firmware.WriteFlashTo(fmw_bin);
         }
 
     } catch (const std::exception &e) {
         std::cerr << "[ - ] Error: " << e.what() << std::endl;
     }
 
+    stats_print();
+
     return 0;
 }
@@ -0,0 +1,140 @@
+#include <sstream>
+#include <iostream>
+#include <cstring>
+#include "util.hpp"
+#include "util_gen.hpp"
+
+// Size with an optional K, M or G suffix
+static uint64_t
+SizeArg(const char *arg)
+{
+    char *end;
+    uint64_t sz = std::strtoull(arg, &end, 10);
+
+    switch (*end) {
+        case 'G':
+            sz <<= 10;
+            [[fallthrough]];
+        case 'M':
+            sz <<= 10;
+            [[fallthrough]];
+        case 'K':
+            sz <<= 10;
+    }
+
+    return sz;
+}
+
+int
+main(int argc, char *argv[])
+{
+    auto usage_print = [&]() {
+        usage(
+            {
+                argv[0],
+                "[-o firmware.bin | -d /path/items]",
+                "[-n items]",
+                "[-s min_size] [-S max_size] [-t fixed|uniform|skewed]",
+                "[-e SECTION,SECTION]",
+                "[-l product_list_size]",
+                "[-O]",
+                "[-r seed]",
+                "[-j threads]",
+            },
+            {
+                "-o Path to save the synthetic firmware.bin",
+                "-d Path to save a synthetic item tree instead (for hw_fmw -p)",
+                "-n Count of items (Default: 8)",
+                "-s Min item size, K/M/G suffix (Default: 0)",
+                "-S Max item size, K/M/G suffix (Default: 1M)",
+                "-t Item size distribution (Default: fixed, every item -S)",
+                "-e Section names, cycled over items (Default: KERNEL,ROOTFS,UBOOT)",
+                "-l Length of the product list (Default: 28)",
+                "-O Old format header (hdr_sz 36 bytes short)",
+                "-r Seed, same seed gives the same image (Default: 0)",
+                "-j Worker threads (Default: all cores)",
+            });
+    };
+
+    std::string path_fmw, path_items, sections = "KERNEL,ROOTFS,UBOOT";
+
+    struct gen_spec spec = {};
+    spec.item_counts     = 8;
+    spec.item_sz_max     = 1 << 20;
+    spec.dist            = GEN_FIXED;
+    spec.prod_list_sz    = 28;
+
+    for (int opt; (opt = getopt(argc, argv, "o:d:n:s:S:t:e:l:Or:j:")) != -1;) {
+        switch (opt) {
+            case 'o':
+                path_fmw = optarg;
+                break;
+            case 'd':
+                path_items = optarg;
+                break;
+            case 'n':
+                spec.item_counts = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 's':
+                spec.item_sz_min = SizeArg(optarg);
+                break;
+            case 'S':
+                spec.item_sz_max = SizeArg(optarg);
+                break;
+            case 't':
+                if (!std::strcmp(optarg, "fixed")) {
+                    spec.dist = GEN_FIXED;
+                } else if (!std::strcmp(optarg, "uniform")) {
+                    spec.dist = GEN_UNIFORM;
+                } else if (!std::strcmp(optarg, "skewed")) {
+                    spec.dist = GEN_SKEWED;
+                } else {
+                    usage_print();
+                }
+                break;
+            case 'e':
+                sections = optarg;
+                break;
+            case 'l':
+                spec.prod_list_sz = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'O':
+                spec.hdr_sz_old = true;
+                break;
+            case 'r':
+                spec.seed = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 'j':
+                spec.threads = std::strtoul(optarg, nullptr, 10);
+                break;
+        }
+    }
+
+    if (path_fmw.empty() == path_items.empty() || !spec.item_counts) {
+        usage_print();
+    }
+
+    std::stringstream section_list(sections);
+
+    for (std::string section; std::getline(section_list, section, ',');) {
+        if (!section.empty()) {
+            spec.sections.push_back(section);
+        }
+    }
+
+    try {
+
+        if (!path_fmw.empty()) {
+            GenImage(spec, path_fmw);
+            std::cout << "[ + ] Synthetic firmware: " << path_fmw << std::endl;
+        } else {
+            GenTree(spec, path_items);
+            std::cout << "[ + ] Synthetic items: " << path_items << std::endl;
+        }
+
+    } catch (const std::exception &e) {
+        std::cerr << "[ - ] Error: " << e.what() << std::endl;
+    }
+
+    return 0;
+}
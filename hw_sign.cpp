@@ -1,8 +1,14 @@
+#include <map>
+#include <atomic>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
+#include <optional>
+#include <getopt.h>
 #include "util.hpp"
 #include "util_hw.hpp"
 #include "util_rsa.hpp"
+#include "util_hashcache.hpp"
 
 int
 main(int argc, char *argv[])
@@ -14,19 +20,52 @@ main(int argc, char *argv[])
                 "-d /path/to/items",
                 "-k private_key.pem",
                 "-o items/var/signature",
+                "[-m]",
+                "[-j threads]",
+                "[--cache file|--no-cache]",
+                "[--stats[=json]]",
             },
             {
                 "-d Path to unpacked files",
                 "-k Path from private_key.pem (Without password)",
                 "-o Path to save signature file",
+                "-m Reuse the SHA-256 of item_list.bin for items unchanged since unpack",
+                "-j Worker threads for hashing (Default: all cores)",
+                "--cache Hash cache (Default: ~/.cache/hwfmw/hash_cache.bin)",
+                "--no-cache Hash every item, the cache is neither read nor written",
+                "--stats Print time, bytes and MB/s per phase to stderr (=json: as JSON)",
             });
     };
 
-    std::string path_items, path_sig_item_list;
+    std::string path_items, path_sig_item_list, path_manifest;
     std::string path_key_priv, path_out_sig;
+    std::string path_cache = HashCache::DefaultPath();
+    size_t threads   = 0;
+    bool fstats_json = false, fmanifest = false;
+
+    const struct option long_opts[] = {
+        { "stats", optional_argument, nullptr, OPT_STATS },
+        { "cache", required_argument, nullptr, OPT_CACHE },
+        { "no-cache", no_argument, nullptr, OPT_NO_CACHE },
+        { "manifest", no_argument, nullptr, 'm' },
+        { nullptr, 0, nullptr, 0 },
+    };
 
-    for (int opt; (opt = getopt(argc, argv, "d:k:o:")) != -1;) {
+    for (int opt; (opt = getopt_long(argc, argv, "d:k:o:j:m", long_opts, nullptr)) != -1;) {
         switch (opt) {
+            case OPT_STATS:
+                if (optarg && std::strcmp(optarg, "json")) {
+                    usage_print();
+                }
+                fstats_json = optarg;
+                StatsEnable();
+                break;
+            case OPT_CACHE:
+                path_cache = optarg;
+                break;
+            case OPT_NO_CACHE:
+                path_cache.clear();
+                break;
             case 'd':
                 path_items = optarg;
                 break;
@@ -36,6 +75,12 @@ main(int argc, char *argv[])
             case 'o':
                 path_out_sig = optarg;
                 break;
+            case 'j':
+                threads = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'm':
+                fmanifest = true;
+                break;
         }
     }
 
@@ -44,6 +89,7 @@ main(int argc, char *argv[])
     }
 
     path_sig_item_list = FilePathOnFS(path_items, "/sig_item_list.txt");
+    path_manifest      = FilePathOnFS(path_items, "/item_list.bin");
 
     try {
 
@@ -52,8 +98,8 @@ main(int argc, char *argv[])
         std::stringstream sig_data;
         std::fstream sig_item_list;
 
-        std::string RSA_key_private =
-            FileRead(path_key_priv, std::ios::in | std::ios::binary);
+        RSAKeyring RSA_key_private(RSA_KEY::PRIVATE,
+                                   FileRead(path_key_priv, std::ios::in | std::ios::binary));
 
         sig_item_list = FileOpen(path_sig_item_list, std::ios::in);
 
@@ -82,18 +128,101 @@ main(int argc, char *argv[])
             throw_err("Empty items on header", "Count of items");
         }
 
-        firmware.ReadItemFromFS(path_items);
         sig_data << firmware.getItemsHeader().size() << '\n'; // Need char '\n'
 
+        // A cache that cannot be read only costs the hashing it would have saved
+        std::optional<HashCache> cache;
+
+        if (!path_cache.empty()) {
+            try {
+                cache.emplace(path_cache);
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Hash cache skipped: " << e.what() << std::endl;
+            }
+        }
+
+        auto &items_hdr = firmware.getItemsHeader();
+        std::vector<std::string> items_sha256(items_hdr.size());
+
+        // SHA-256 recorded at unpack, used while the file is still the one unpacked.
+        // Racily clean files are hashed again and refresh their record.
+        std::optional<Manifest> manifest;
+        // Record of each item picked, manifest->size() for none
+        std::vector<size_t> items_rec;
+
+        if (fmanifest) {
+            manifest.emplace(path_manifest);
+
+            std::map<std::string_view, size_t> records;
+
+            for (size_t i = 0; i < manifest->size(); ++i) {
+                auto &hi = manifest->at(i).hi;
+                records.emplace(std::string_view(hi.item, strnlen(hi.item, sizeof(hi.item))), i);
+            }
+
+            for (auto &hi : items_hdr) {
+                auto it = records.find(hi.item);
+                items_rec.push_back(it != records.end() ? it->second : manifest->size());
+            }
+        }
+
+        // Racily clean records found unchanged by their hash, as git refreshes its index
+        std::vector<struct file_id> ids_refresh(manifest ? manifest->size() : 0);
+        std::atomic<bool> refresh = false;
+
+        // Items are streamed from FS, never loaded whole
+        ParallelFor(items_hdr.size(), threads, [&](size_t i) {
+            auto item_path =
+                FilePathOnFS(path_items, firmware.PathItemOnFmw(items_hdr.at(i).item));
+
+            size_t rec    = manifest ? items_rec.at(i) : 0;
+            bool recorded = manifest && rec < manifest->size();
+
+            if (recorded && manifest->Unchanged(rec, item_path)) {
+                auto &sha256 = manifest->at(rec).sha256;
+                items_sha256.at(i).assign(sha256, sizeof(sha256));
+                return;
+            }
+
+            auto id = recorded ? FileId(item_path) : file_id {};
+
+            if (cache) {
+                items_sha256.at(i) = cache->Digest(item_path).sha256;
+            } else {
+                items_sha256.at(i) = sha256_file(item_path);
+            }
+
+            if (recorded && FileId(item_path) == id &&
+                items_sha256.at(i) == std::string_view(manifest->at(rec).sha256,
+                                                       sizeof(manifest->at(rec).sha256))) {
+                ids_refresh.at(rec) = id;
+                refresh             = true;
+            }
+        });
+
+        if (refresh) {
+            try {
+                manifest->Refresh(path_manifest, ids_refresh, FileClockNs());
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Manifest not refreshed: " << e.what() << std::endl;
+            }
+        }
+
+        if (cache) {
+            try {
+                cache->Flush();
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Hash cache not saved: " << e.what() << std::endl;
+            }
+        }
+
         for (size_t i = 0; i < firmware.getItemsHeader().size(); ++i) {
 
-            auto &hi  = firmware.getItemsHeader().at(i);
-            auto &raw = firmware.getItemsRaw().at(i);
+            auto &hi = firmware.getItemsHeader().at(i);
 
-            auto item_path   = firmware.PathItemOnFmw(hi.item);
-            auto item_sha256 = sha256_sum(raw.data(), raw.size());
+            auto item_path = firmware.PathItemOnFmw(hi.item);
 
-            sig_data << item_sha256 << ' ' << item_path << '\n';
+            sig_data << items_sha256.at(i) << ' ' << item_path << '\n';
         }
 
         sig_data << firmware.CryptoSign(sig_data.str(), RSA_key_private);
@@ -107,5 +236,9 @@ main(int argc, char *argv[])
         std::cerr << "[ - ] Error. " << e.what() << std::endl;
     }
 
+    if (StatsEnabled()) {
+        StatsPrint(std::cerr, fstats_json);
+    }
+
     return 0;
 }
@@ -1,8 +1,53 @@
+#include <cstring>
 #include <iomanip>
 #include <sstream>
+#include <optional>
+#include <getopt.h>
 #include "util.hpp"
 #include "util_hw.hpp"
 #include "util_rsa.hpp"
+#include "util_hashcache.hpp"
+
+struct sig_entry {
+    std::string sha256_str;
+    std::string item_path;
+    std::string item_sha256;
+    std::exception_ptr err;
+};
+
+struct sig_file {
+    std::string path;
+    std::string buf;
+    std::vector<struct sig_entry> entries;
+    std::exception_ptr err;
+};
+
+static void
+SigFileRead(struct sig_file &sf, const std::string &path_items)
+{
+    uint32_t item_counts = 0;
+    std::stringstream sig_file_buf;
+
+    sf.buf = FileRead(sf.path, std::ios::in | std::ios::binary);
+    sig_file_buf << sf.buf;
+
+    if (sig_file_buf >> item_counts; !item_counts) {
+        throw_err("items_hdr.size() == 0", "Count of items");
+    }
+
+    // The count is untrusted, entries are only kept once they parse
+    while (sf.entries.size() < item_counts) {
+        struct sig_entry e;
+        std::string item_path_str;
+
+        if (!(sig_file_buf >> e.sha256_str >> item_path_str)) {
+            throw_err("!(buf >> sha256 >> item_path)", "Format file signature");
+        }
+
+        e.item_path = FilePathOnFS(path_items, item_path_str);
+        sf.entries.push_back(std::move(e));
+    }
+}
 
 int
 main(int argc, char *argv[])
@@ -13,19 +58,45 @@ main(int argc, char *argv[])
                 argv[0],
                 "-d /path/to/items",
                 "-k public_key.pem",
-                "-i items/var/signature",
+                "-i items/var/signature [-i ...]",
+                "[-j threads]",
+                "[--cache file]",
+                "[--stats[=json]]",
             },
             {
                 "-d Path to unpacked files",
                 "-k Path from pubsigkey.pem",
-                "-i Path from signature file",
+                "-i Path from signature file (Repeat for many)",
+                "-j Worker threads for hashing (Default: all cores)",
+                "--cache Take unchanged items from a hash cache (Default: hash every item)",
+                "--stats Print time, bytes and MB/s per phase to stderr (=json: as JSON)",
             });
     };
 
-    std::string path_items, path_key_pub, path_in_sig;
+    std::string path_items, path_key_pub;
+    std::string path_cache; // Off: a verify checks what is on disk now
+    std::vector<std::string> paths_in_sig;
+    size_t threads   = 0;
+    bool fstats_json = false;
+
+    const struct option long_opts[] = {
+        { "stats", optional_argument, nullptr, OPT_STATS },
+        { "cache", required_argument, nullptr, OPT_CACHE },
+        { nullptr, 0, nullptr, 0 },
+    };
 
-    for (int opt; (opt = getopt(argc, argv, "d:k:i:")) != -1;) {
+    for (int opt; (opt = getopt_long(argc, argv, "d:k:i:j:", long_opts, nullptr)) != -1;) {
         switch (opt) {
+            case OPT_STATS:
+                if (optarg && std::strcmp(optarg, "json")) {
+                    usage_print();
+                }
+                fstats_json = optarg;
+                StatsEnable();
+                break;
+            case OPT_CACHE:
+                path_cache = optarg;
+                break;
             case 'd':
                 path_items = optarg;
                 break;
@@ -33,54 +104,135 @@ main(int argc, char *argv[])
                 path_key_pub = optarg;
                 break;
             case 'i':
-                path_in_sig = optarg;
+                paths_in_sig.push_back(optarg);
+                break;
+            case 'j':
+                threads = std::strtoul(optarg, nullptr, 10);
                 break;
         }
     }
 
-    if (path_items.empty() || path_key_pub.empty() || path_in_sig.empty()) {
+    if (path_items.empty() || path_key_pub.empty() || paths_in_sig.empty()) {
         usage_print();
     }
 
     try {
 
         Firmware firmware = {};
-        uint32_t item_counts;
-        std::string RSA_key_public;
-        std::stringstream sig_file_buf;
 
-        RSA_key_public = FileRead(path_key_pub, std::ios::in | std::ios::binary);
-        sig_file_buf << FileRead(path_in_sig, std::ios::in | std::ios::binary);
+        // Key is parsed once for every signature file
+        RSAKeyring RSA_key_public(RSA_KEY::PUBLIC,
+                                  FileRead(path_key_pub, std::ios::in | std::ios::binary));
+
+        std::vector<struct sig_file> sig_files(paths_in_sig.size());
+        std::vector<struct sig_entry *> entries;
+
+        for (size_t i = 0; i < sig_files.size(); ++i) {
+            auto &sf = sig_files.at(i);
+            sf.path  = paths_in_sig.at(i);
 
-        if (sig_file_buf >> item_counts; !item_counts) {
-            throw_err("items_hdr.size() == 0", "Count of items");
+            try {
+                SigFileRead(sf, path_items);
+            } catch (...) {
+                sf.err = std::current_exception();
+            }
+
+            for (auto &e : sf.entries) {
+                entries.push_back(&e);
+            }
         }
 
-        for (size_t i = 0; i < item_counts; ++i) {
+        // A cache that cannot be read only costs the hashing it would have saved
+        std::optional<HashCache> cache;
 
-            std::string sha256_str, item_path_str;
+        if (!path_cache.empty()) {
+            try {
+                cache.emplace(path_cache);
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Hash cache skipped: " << e.what() << std::endl;
+            }
+        }
 
-            if (!(sig_file_buf >> sha256_str >> item_path_str)) {
-                throw_err("!(buf >> sha256 >> item_path)", "Format file signature");
+        ParallelFor(entries.size(), threads, [&](size_t i) {
+            auto &e = *entries.at(i);
+
+            try {
+                e.item_sha256 = cache ? cache->Digest(e.item_path).sha256
+                                      : sha256_file(e.item_path);
+            } catch (...) {
+                e.err = std::current_exception();
+            }
+        });
+
+        if (cache) {
+            try {
+                cache->Flush();
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Hash cache not saved: " << e.what() << std::endl;
             }
+        }
+
+        std::vector<struct rsa_sig_pair> sig_pairs;
+        std::vector<size_t> sig_pairs_file(sig_files.size(), 0);
 
-            auto item_path = FilePathOnFS(path_items, item_path_str);
+        for (size_t i = 0; i < sig_files.size(); ++i) {
+            auto &sf = sig_files.at(i);
 
-            auto item_raw    = FileRead(item_path, std::ios::in | std::ios::binary);
-            auto item_sha256 = sha256_sum(item_raw.data(), item_raw.size());
+            if (sf.err) {
+                continue;
+            }
 
-            std::cout << (!sha256_str.compare(item_sha256) ? "[ + ] " : "[ - ] ")
-                      << "Verify sha256: " << item_path << std::endl;
+            try {
+                sig_pairs_file.at(i) = sig_pairs.size();
+                sig_pairs.push_back(firmware.CryptoSplit(sf.buf));
+            } catch (...) {
+                sf.err = std::current_exception();
+            }
         }
 
-        std::cout << (firmware.CryptoVerify(sig_file_buf.str(), RSA_key_public)
-                          ? "[ + ] "
-                          : "[ - ] ")
-                  << "Verify Signature with public key:" << path_key_pub << std::endl;
+        auto sig_verified = RSA_key_public.VerifyBatch(sig_pairs, threads);
+
+        // Report in signature file order, a file stops at its first unreadable item
+        for (size_t i = 0; i < sig_files.size(); ++i) {
+            auto &sf = sig_files.at(i);
+
+            if (sig_files.size() > 1) {
+                std::cout << "[ * ] Signature file: " << sf.path << std::endl;
+            }
+
+            try {
+
+                if (sf.err) {
+                    std::rethrow_exception(sf.err);
+                }
+
+                for (auto &e : sf.entries) {
+
+                    if (e.err) {
+                        std::rethrow_exception(e.err);
+                    }
+
+                    std::cout << (!e.sha256_str.compare(e.item_sha256) ? "[ + ] "
+                                                                       : "[ - ] ")
+                              << "Verify sha256: " << e.item_path << std::endl;
+                }
+
+                std::cout << (sig_verified.at(sig_pairs_file.at(i)) ? "[ + ] " : "[ - ] ")
+                          << "Verify Signature with public key:" << path_key_pub
+                          << std::endl;
+
+            } catch (const std::exception &e) {
+                std::cerr << "[ - ] Error. " << e.what() << std::endl;
+            }
+        }
 
     } catch (const std::exception &e) {
         std::cerr << "[ - ] Error. " << e.what() << std::endl;
     }
 
+    if (StatsEnabled()) {
+        StatsPrint(std::cerr, fstats_json);
+    }
+
     return 0;
 }
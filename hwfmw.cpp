@@ -0,0 +1,379 @@
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include "util.hpp"
+#include "util_hw.hpp"
+#include "hwfmw.h"
+
+// Table fields fill their arrays with no NUL when at full length
+struct hwfmw_names {
+    std::string item, section, version;
+};
+
+struct hwfmw {
+    Firmware fw = {};
+
+    std::string fmw_copy; // Backing storage of a parse with copy
+    mutable std::string err;
+    // What hwfmw_item_info() points into, rebuilt after the item table changes
+    mutable std::vector<struct hwfmw_names> names;
+
+    bool parsed = false;
+    bool packed = false;
+};
+
+// Exceptions never cross the C ABI, they become a code and a message
+template <typename Fn>
+static int
+hwfmw_guard(const hwfmw *h, enum hwfmw_err err_code, Fn &&fn)
+{
+    if (!h) {
+        return HWFMW_ERR_ARG;
+    }
+
+    h->err.clear();
+
+    try {
+        return fn();
+    } catch (const std::bad_alloc &) {
+        h->err = "Out of memory";
+        return HWFMW_ERR_NOMEM;
+    } catch (const std::exception &e) {
+        h->err = e.what();
+        return err_code;
+    } catch (...) {
+        h->err = "Unknown error";
+        return HWFMW_ERR_OTHER;
+    }
+}
+
+static int
+hwfmw_fail(const hwfmw *h, enum hwfmw_err err_code, const char *msg)
+{
+    h->err = msg;
+    return err_code;
+}
+
+template <size_t N>
+static std::string_view
+hwfmw_field(const char (&field)[N])
+{
+    return { field, strnlen(field, N) };
+}
+
+hwfmw *
+hwfmw_new(void)
+{
+    try {
+        auto h = new hwfmw;
+        h->fw.SetThreads(1);
+
+        return h;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void
+hwfmw_free(hwfmw *h)
+{
+    delete h;
+}
+
+const char *
+hwfmw_last_error(const hwfmw *h)
+{
+    return h ? h->err.c_str() : "NULL handle";
+}
+
+int
+hwfmw_set_threads(hwfmw *h, size_t threads)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        h->fw.SetThreads(threads);
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_parse(hwfmw *h, const void *data, size_t sz, int copy)
+{
+    return hwfmw_guard(h, HWFMW_ERR_FORMAT, [&]() -> int {
+        if (!data && sz) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL data");
+        }
+
+        h->parsed = h->packed = false;
+        h->names.clear();
+
+        std::string_view fmw(static_cast<const char *>(data), sz);
+
+        if (copy) {
+            h->fmw_copy.assign(fmw);
+            fmw = h->fmw_copy;
+        } else {
+            h->fmw_copy.clear();
+        }
+
+        h->fw.ReadFlashFromMem(fmw);
+        h->parsed = true;
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_verify_crc32(hwfmw *h, size_t *items_bad)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!h->parsed) {
+            return hwfmw_fail(h, HWFMW_ERR_STATE, "Nothing parsed");
+        }
+
+        auto report = h->fw.VerifyCRC32();
+        auto bad    = std::count(report.items_ok.begin(), report.items_ok.end(), false);
+
+        if (items_bad) {
+            *items_bad = bad;
+        }
+
+        return report.raw_ok && report.hdr_ok && !bad ? HWFMW_OK : HWFMW_ERR_CRC32;
+    });
+}
+
+int
+hwfmw_item_count(const hwfmw *h, size_t *count)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!count) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL count");
+        }
+
+        *count = h->fw.getItemsHeader().size();
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_item_info(const hwfmw *h, size_t i, struct hwfmw_item_info *info)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        auto &items_hdr = h->fw.getItemsHeader();
+
+        if (!info) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL info");
+        }
+
+        if (i >= items_hdr.size()) {
+            return hwfmw_fail(h, HWFMW_ERR_RANGE, "Item out of range");
+        }
+
+        if (h->names.size() != items_hdr.size()) {
+            h->names.clear();
+
+            for (auto &hi : items_hdr) {
+                h->names.push_back({ std::string(hwfmw_field(hi.item)),
+                                     std::string(hwfmw_field(hi.section)),
+                                     std::string(hwfmw_field(hi.version)) });
+            }
+        }
+
+        auto &hi    = items_hdr.at(i);
+        auto &names = h->names.at(i);
+
+        info->iter     = hi.iter;
+        info->crc32    = hi.item_crc32;
+        info->data_off = hi.data_off;
+        info->data_sz  = h->fw.ItemSize(i);
+        info->item     = names.item.c_str();
+        info->section  = names.section.c_str();
+        info->version  = names.version.c_str();
+        info->policy   = hi.policy;
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_item_data(const hwfmw *h, size_t i, const void **data, size_t *sz)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        auto &items_raw = h->fw.getItemsRaw();
+
+        if (!data || !sz) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL data");
+        }
+
+        if (i >= items_raw.size()) {
+            return hwfmw_fail(h, HWFMW_ERR_RANGE, "Item out of range");
+        }
+
+        *data = items_raw.at(i).data();
+        *sz   = items_raw.at(i).size();
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_item_find(const hwfmw *h, const char *item, size_t *i)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!item || !i) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL item");
+        }
+
+        auto &items_hdr = h->fw.getItemsHeader();
+
+        for (size_t ix = 0; ix < items_hdr.size(); ++ix) {
+            if (hwfmw_field(items_hdr.at(ix).item) == item) {
+                *i = ix;
+                return HWFMW_OK;
+            }
+        }
+
+        return hwfmw_fail(h, HWFMW_ERR_RANGE, "Item not found");
+    });
+}
+
+int
+hwfmw_item_replace(hwfmw *h, size_t i, const void *data, size_t sz)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!data && sz) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL data");
+        }
+
+        if (i >= h->fw.getItemsHeader().size()) {
+            return hwfmw_fail(h, HWFMW_ERR_RANGE, "Item out of range");
+        }
+
+        std::string raw(static_cast<const char *>(data), sz);
+        h->fw.ReplaceItemRaw(i, raw);
+        h->packed = false;
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_item_add(hwfmw *h,
+               const char *item,
+               const char *section,
+               const char *version,
+               uint32_t policy,
+               const void *data,
+               size_t sz)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        struct huawei_item hi = {};
+
+        if (!h->parsed) {
+            return hwfmw_fail(h, HWFMW_ERR_STATE, "Nothing parsed");
+        }
+
+        if (!item || !section || (!data && sz)) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL item, section or data");
+        }
+
+        // Fields are NUL terminated on flash
+        if (std::strlen(item) >= sizeof(hi.item) || std::strlen(section) >= sizeof(hi.section) ||
+            (version && std::strlen(version) >= sizeof(hi.version))) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "Item, section or version too long");
+        }
+
+        hi.iter   = h->fw.getItemsHeader().size();
+        hi.policy = policy;
+
+        std::strcpy(hi.item, item);
+        std::strcpy(hi.section, section);
+        std::strcpy(hi.version, version ? version : "");
+
+        std::string raw(static_cast<const char *>(data), sz);
+        h->fw.AddItemHeader(hi);
+        h->fw.AddItemRaw(raw);
+        h->packed = false;
+        h->names.clear();
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_pack(hwfmw *h, size_t *sz)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!h->parsed) {
+            return hwfmw_fail(h, HWFMW_ERR_STATE, "Nothing parsed");
+        }
+
+        // Offsets are 32 bit on flash, the one limit edits can hit
+        if (h->fw.FlashSize() > UINT32_MAX) {
+            return hwfmw_fail(h, HWFMW_ERR_RANGE, "Image over 4 GiB");
+        }
+
+        h->fw.PackToMem();
+        h->packed = true;
+
+        if (sz) {
+            *sz = h->fw.FlashSize();
+        }
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_write(hwfmw *h, void *buf, size_t buf_sz, size_t *written)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!h->packed) {
+            return hwfmw_fail(h, HWFMW_ERR_STATE, "Not packed");
+        }
+
+        if (!buf || !written) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL buffer");
+        }
+
+        size_t fmw_sz = h->fw.FlashSize();
+
+        if (buf_sz < fmw_sz) {
+            *written = fmw_sz;
+            return hwfmw_fail(h, HWFMW_ERR_RANGE, "Buffer too small");
+        }
+
+        auto out = static_cast<char *>(buf);
+
+        h->fw.WriteFlashTo([&](std::string_view chunk) {
+            std::memcpy(out, chunk.data(), chunk.size());
+            out += chunk.size();
+        });
+
+        *written = fmw_sz;
+
+        return HWFMW_OK;
+    });
+}
+
+int
+hwfmw_write_cb(hwfmw *h, hwfmw_writer writer, void *ctx)
+{
+    return hwfmw_guard(h, HWFMW_ERR_OTHER, [&]() -> int {
+        if (!h->packed) {
+            return hwfmw_fail(h, HWFMW_ERR_STATE, "Not packed");
+        }
+
+        if (!writer) {
+            return hwfmw_fail(h, HWFMW_ERR_ARG, "NULL writer");
+        }
+
+        h->fw.WriteFlashTo([&](std::string_view chunk) {
+            if (writer(ctx, chunk.data(), chunk.size()) != chunk.size()) {
+                throw_err("Writer stopped", std::to_string(chunk.size()));
+            }
+        });
+
+        return HWFMW_OK;
+    });
+}
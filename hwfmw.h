@@ -0,0 +1,82 @@
+#ifndef HWFMW_H
+#define HWFMW_H
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+extern "C" {
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#define HWFMW_API __attribute__((visibility("default")))
+
+// Every call returns one of these, hwfmw_last_error() has the details
+enum hwfmw_err {
+    HWFMW_OK         = 0,
+    HWFMW_ERR_ARG    = -1, // NULL handle or pointer, bad argument
+    HWFMW_ERR_FORMAT = -2, // Not an HWNP image, or truncated
+    HWFMW_ERR_RANGE  = -3, // Item index out of range, output buffer too small, image over 4 GiB
+    HWFMW_ERR_CRC32  = -4, // Image parsed but CRC32 does not match
+    HWFMW_ERR_NOMEM  = -5,
+    HWFMW_ERR_STATE  = -6, // Nothing parsed yet, or not packed since the last change
+    HWFMW_ERR_OTHER  = -7
+};
+
+typedef struct hwfmw hwfmw;
+
+struct hwfmw_item_info {
+    uint32_t iter;
+    uint32_t crc32;
+    uint32_t data_off;
+    uint32_t data_sz;
+
+    const char *item;    // NUL terminated, valid until the next parse or item add
+    const char *section;
+    const char *version;
+
+    uint32_t policy;
+};
+
+// Returns the bytes it took, anything else than sz stops the write
+typedef size_t (*hwfmw_writer)(void *ctx, const void *data, size_t sz);
+
+// Handles are independent, one handle must not be used by two threads at once
+HWFMW_API hwfmw *hwfmw_new(void);
+HWFMW_API void hwfmw_free(hwfmw *fw);
+HWFMW_API const char *hwfmw_last_error(const hwfmw *fw);
+
+// Worker threads for CRC32 (Default: 1, 0 - all cores)
+HWFMW_API int hwfmw_set_threads(hwfmw *fw, size_t threads);
+
+// copy == 0: no copy is made, data must stay valid until the next parse or free
+HWFMW_API int hwfmw_parse(hwfmw *fw, const void *data, size_t sz, int copy);
+HWFMW_API int hwfmw_verify_crc32(hwfmw *fw, size_t *items_bad);
+
+HWFMW_API int hwfmw_item_count(const hwfmw *fw, size_t *count);
+HWFMW_API int hwfmw_item_info(const hwfmw *fw, size_t i, struct hwfmw_item_info *info);
+HWFMW_API int hwfmw_item_data(const hwfmw *fw, size_t i, const void **data, size_t *sz);
+HWFMW_API int hwfmw_item_find(const hwfmw *fw, const char *item, size_t *i);
+
+// Payloads are copied, the caller's buffer can be reused right away
+HWFMW_API int hwfmw_item_replace(hwfmw *fw, size_t i, const void *data, size_t sz);
+HWFMW_API int hwfmw_item_add(hwfmw *fw,
+                             const char *item,
+                             const char *section,
+                             const char *version,
+                             uint32_t policy,
+                             const void *data,
+                             size_t sz);
+
+// Lays out and checksums the image, *sz is the size hwfmw_write() needs
+HWFMW_API int hwfmw_pack(hwfmw *fw, size_t *sz);
+// HWFMW_ERR_RANGE if buf_sz is short, *written is then the size needed
+HWFMW_API int hwfmw_write(hwfmw *fw, void *buf, size_t buf_sz, size_t *written);
+HWFMW_API int hwfmw_write_cb(hwfmw *fw, hwfmw_writer writer, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HWFMW_H
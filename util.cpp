@@ -1,8 +1,22 @@
+#include <mutex>
+#include <atomic>
 #include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <cstring>
 #include <sstream>
+#include <iomanip>
 #include <iostream>
 #include <filesystem>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "util.hpp"
 
 void
@@ -43,6 +57,198 @@ usage(std::initializer_list<std::string> example, std::initializer_list<std::str
     std::exit(EXIT_FAILURE);
 }
 
+size_t
+ParallelWorkers(size_t count, size_t threads)
+{
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    return std::max<size_t>(1, std::min(threads, count));
+}
+
+void
+ParallelFor(size_t count, size_t threads, const std::function<void(size_t, size_t)> &fn)
+{
+    threads = ParallelWorkers(count, threads);
+
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i, 0);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr err;
+    std::mutex err_lock;
+
+    auto worker = [&](size_t worker_ix) {
+        for (size_t i; (i = next.fetch_add(1)) < count;) {
+            try {
+                fn(i, worker_ix);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(err_lock);
+                if (!err) {
+                    err = std::current_exception();
+                }
+                next = count; // Stop other workers
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(worker, i);
+    }
+
+    worker(0);
+
+    for (auto &t : pool) {
+        t.join();
+    }
+
+    if (err) {
+        std::rethrow_exception(err);
+    }
+}
+
+void
+ParallelFor(size_t count, size_t threads, const std::function<void(size_t)> &fn)
+{
+    ParallelFor(count, threads, [&](size_t i, size_t) { fn(i); });
+}
+
+void
+Semaphore::lock()
+{
+    std::unique_lock<std::mutex> lk(this->count_lock);
+    this->cv.wait(lk, [this]() { return this->count > 0; });
+    --this->count;
+}
+
+void
+Semaphore::unlock()
+{
+    {
+        std::lock_guard<std::mutex> lk(this->count_lock);
+        ++this->count;
+    }
+    this->cv.notify_one();
+}
+
+std::string
+JsonEscape(const std::string &str)
+{
+    std::string out;
+
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+
+    return out;
+}
+
+std::atomic<bool> stats_enabled(false);
+
+struct stat_counter {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> ns;
+    std::atomic<uint64_t> bytes;
+};
+
+static struct stat_counter stats[STAT_PHASE_MAX];
+
+static const char *stat_names[STAT_PHASE_MAX] = {
+    "file_read",   // STAT_FILE_READ
+    "file_write",  // STAT_FILE_WRITE
+    "file_copy",   // STAT_FILE_COPY
+    "file_clone",  // STAT_FILE_CLONE
+    "read_flash",  // STAT_READ_FLASH
+    "unpack",      // STAT_UNPACK
+    "pack",        // STAT_PACK
+    "write_flash", // STAT_WRITE_FLASH
+    "crc32",       // STAT_CRC32
+    "sha256",      // STAT_SHA256
+    "rsa_sign",    // STAT_RSA_SIGN
+    "rsa_verify",  // STAT_RSA_VERIFY
+    "inflate",     // STAT_INFLATE
+};
+
+void
+StatsEnable()
+{
+    stats_enabled.store(true, std::memory_order_relaxed);
+}
+
+void
+StatsAdd(enum STAT_PHASE phase, uint64_t ns, uint64_t bytes)
+{
+    auto &c = stats[phase];
+
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    c.ns.fetch_add(ns, std::memory_order_relaxed);
+    c.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void
+StatsPrint(std::ostream &os, bool json)
+{
+    auto flags = os.flags();
+
+    os << std::fixed << std::setprecision(1);
+
+    if (json) {
+        os << "{\"phases\": [";
+    } else {
+        os << "[ * ] " << std::left << std::setw(12) << "Phase" << std::right << std::setw(8)
+           << "Calls" << std::setw(12) << "Time ms" << std::setw(14) << "Bytes"
+           << std::setw(10) << "MB/s" << std::endl;
+    }
+
+    bool first = true;
+
+    for (int i = 0; i < STAT_PHASE_MAX; ++i) {
+        auto &c = stats[i];
+
+        uint64_t calls = c.calls.load(), ns = c.ns.load(), bytes = c.bytes.load();
+
+        if (!calls) {
+            continue;
+        }
+
+        double ms   = ns / 1e6;
+        double mb_s = ns ? bytes * 1e3 / ns : 0;
+
+        if (json) {
+            os << (first ? "" : ", ") << "{\"phase\": \"" << stat_names[i]
+               << "\", \"calls\": " << calls << ", \"time_ms\": " << ms
+               << ", \"bytes\": " << bytes << ", \"mb_s\": " << mb_s << "}";
+        } else {
+            os << "[ * ] " << std::left << std::setw(12) << stat_names[i] << std::right
+               << std::setw(8) << calls << std::setw(12) << ms << std::setw(14) << bytes
+               << std::setw(10) << mb_s << std::endl;
+        }
+
+        first = false;
+    }
+
+    if (json) {
+        os << "]}" << std::endl;
+    }
+
+    os.flags(flags);
+}
+
 std::string
 FilePathOnFS(const std::string &dir, const std::string &base)
 {
@@ -75,6 +281,8 @@ FileRead(std::fstream fd)
     const size_t sz = fd.seekg(0, std::ios::end).tellg();
     fd.seekg(std::ios::beg);
 
+    StatScope stat(STAT_FILE_READ, sz);
+
     std::string buf(sz, '\0');
 
     if (!fd.read(buf.data(), buf.size())) {
@@ -89,3 +297,523 @@ FileRead(const std::string &fname, std::ios::openmode m)
 {
     return FileRead(FileOpen(fname, m));
 }
+
+void
+FileWrite(const std::string &fname,
+          std::string_view data,
+          const std::function<void(std::string_view)> &chunk_cb)
+{
+    int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        throw_err("open()", fname);
+    }
+
+    try {
+        for (size_t off = 0; off < data.size();) {
+            // chunk_cb sees every byte once, right before it is written
+            auto chunk = data.substr(off, chunk_cb ? IO_CHUNK_SZ : data.size());
+
+            if (chunk_cb) {
+                chunk_cb(chunk);
+            }
+
+            FileWriteAt(fd, chunk, off);
+            off += chunk.size();
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd)) {
+        throw_err("close()", fname);
+    }
+}
+
+size_t
+FileReadAt(int fd, char *buf, size_t sz, uint64_t off)
+{
+    StatScope stat(STAT_FILE_READ);
+
+    ssize_t n;
+
+    while ((n = pread(fd, buf, sz, off)) < 0 && errno == EINTR) {
+    }
+
+    if (n < 0) {
+        throw_err("pread()", std::to_string(off));
+    }
+
+    stat.AddBytes(n);
+
+    return n;
+}
+
+void
+FileWriteAt(int fd, std::string_view data, uint64_t off)
+{
+    StatScope stat(STAT_FILE_WRITE, data.size());
+
+    for (size_t done = 0; done < data.size();) {
+        ssize_t n = pwrite(fd, data.data() + done, data.size() - done, off + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            throw_err("pwrite()", std::to_string(off + done));
+        }
+
+        done += n;
+    }
+}
+
+void
+FileWriteVAt(int fd, const std::vector<std::string_view> &chunks, uint64_t off)
+{
+    std::vector<struct iovec> iov;
+    uint64_t sz = 0;
+
+    for (auto &chunk : chunks) {
+        if (!chunk.empty()) {
+            iov.push_back({ const_cast<char *>(chunk.data()), chunk.size() });
+            sz += chunk.size();
+        }
+    }
+
+    StatScope stat(STAT_FILE_WRITE, sz);
+
+    for (size_t ix = 0; ix < iov.size();) {
+        ssize_t n = pwritev(fd, iov.data() + ix, std::min<size_t>(iov.size() - ix, IOV_MAX), off);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            throw_err("pwritev()", std::to_string(off));
+        }
+
+        off += n;
+
+        // Short write: drop what went out, resume inside the current chunk
+        for (size_t left = n; left;) {
+            auto &v = iov.at(ix);
+
+            if (left >= v.iov_len) {
+                left -= v.iov_len;
+                ++ix;
+            } else {
+                v.iov_base = static_cast<char *>(v.iov_base) + left;
+                v.iov_len -= left;
+                left = 0;
+            }
+        }
+    }
+}
+
+std::string
+FileTempPath(const std::string &fname)
+{
+    static std::atomic<uint64_t> counter = 0;
+
+    return fname + ".tmp." + std::to_string(getpid()) + '.' + std::to_string(counter++);
+}
+
+bool
+FileTempName(const std::string &fname)
+{
+    auto base = std::filesystem::path(fname).filename().string();
+    auto tmp  = base.rfind(".tmp.");
+
+    return tmp != std::string::npos &&
+           std::count(base.begin() + tmp + 5, base.end(), '.') == 1 &&
+           base.find_first_not_of("0123456789.", tmp + 5) == std::string::npos;
+}
+
+FileAtomic::FileAtomic(const std::string &fname, uint64_t sz)
+    : path(fname)
+    , path_tmp(FileTempPath(fname))
+{
+    this->fd = open(this->path_tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+    if (this->fd < 0) {
+        throw_err("open()", this->path_tmp);
+    }
+
+    // Not every FS has it, the write still works without
+    if (sz && fallocate(this->fd, 0, 0, sz) && errno != EOPNOTSUPP && errno != ENOSYS) {
+        int err = errno;
+
+        close(this->fd);
+        unlink(this->path_tmp.c_str());
+
+        errno = err;
+        throw_err("fallocate()", this->path_tmp);
+    }
+}
+
+FileAtomic::~FileAtomic()
+{
+    if (this->fd >= 0) {
+        close(this->fd);
+        unlink(this->path_tmp.c_str());
+    }
+}
+
+void
+FileAtomic::Commit()
+{
+    int fd_tmp = this->fd;
+    this->fd   = -1;
+
+    const char *err_expr = nullptr;
+    struct stat st;
+
+    // Permission bits of the file replaced, the temp file got 0666 & ~umask
+    if (!stat(this->path.c_str(), &st) && S_ISREG(st.st_mode) &&
+        fchmod(fd_tmp, st.st_mode & 07777)) {
+        err_expr = "fchmod()";
+    }
+
+    // Data on disk before the name points at it: a crash leaves the old file or
+    // the whole new one, never an empty one
+    if (!err_expr && fsync(fd_tmp)) {
+        err_expr = "fsync()";
+    }
+
+    if (close(fd_tmp) && !err_expr) {
+        err_expr = "close()";
+    }
+
+    if (!err_expr && rename(this->path_tmp.c_str(), this->path.c_str())) {
+        err_expr = "rename()";
+    }
+
+    if (err_expr) {
+        int err = errno;
+
+        unlink(this->path_tmp.c_str());
+
+        errno = err;
+        throw_err(err_expr, this->path);
+    }
+}
+
+void
+FileCopyRange(const std::string &fname,
+              int fd_out,
+              uint64_t off_out,
+              uint64_t sz,
+              const std::function<void(std::string_view)> &chunk_cb)
+{
+    StatScope stat(STAT_FILE_COPY, sz);
+
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        throw_err("open()", fname);
+    }
+
+    uint64_t done = 0;
+
+    try {
+        // Kernel side copy, a reflink on filesystems that support it
+        for (loff_t off_in = 0, off = off_out; !chunk_cb && done < sz;) {
+            ssize_t n = copy_file_range(fd, &off_in, fd_out, &off, sz - done, 0);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                break; // Unsupported or short file, the loop below tells which
+            }
+
+            done += n;
+        }
+
+        thread_local std::string buf(IO_CHUNK_SZ, '\0');
+
+        while (done < sz) {
+            size_t n = FileReadAt(fd, buf.data(), std::min<uint64_t>(buf.size(), sz - done), done);
+
+            if (!n) {
+                throw_err("File changed while copying", fname);
+            }
+
+            std::string_view chunk(buf.data(), n);
+
+            if (chunk_cb) {
+                chunk_cb(chunk);
+            }
+
+            FileWriteAt(fd_out, chunk, off_out + done);
+            done += n;
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+void
+FileCloneRange(int fd_in, uint64_t off_in, uint64_t sz, const std::string &fname)
+{
+    struct stat st;
+
+    if (fstat(fd_in, &st)) {
+        throw_err("fstat()", fname);
+    }
+
+    int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        throw_err("open()", fname);
+    }
+
+    uint64_t done = 0;
+
+    try {
+        // Reflinks take whole blocks, only a range that ends the file may be short
+        uint64_t blk      = st.st_blksize;
+        uint64_t clone_sz = off_in + sz == uint64_t(st.st_size) ? sz : sz / blk * blk;
+
+        if (blk && !(off_in % blk) && clone_sz) {
+            StatScope stat(STAT_FILE_CLONE);
+
+            struct file_clone_range range = {};
+            range.src_fd                  = fd_in;
+            range.src_offset              = off_in;
+            range.src_length              = clone_sz;
+
+            // EOPNOTSUPP, EXDEV or EINVAL: nothing shared, everything is copied
+            if (!ioctl(fd, FICLONERANGE, &range)) {
+                stat.AddBytes(clone_sz);
+                done = clone_sz;
+            }
+        }
+
+        StatScope stat(STAT_FILE_COPY, sz - done);
+
+        for (loff_t off = off_in + done, off_out = done; done < sz;) {
+            ssize_t n = copy_file_range(fd_in, &off, fd, &off_out, sz - done, 0);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                break; // Unsupported or short file, the loop below tells which
+            }
+
+            done += n;
+        }
+
+        thread_local std::string buf(IO_CHUNK_SZ, '\0');
+
+        while (done < sz) {
+            size_t n = FileReadAt(
+                fd_in, buf.data(), std::min<uint64_t>(buf.size(), sz - done), off_in + done);
+
+            if (!n) {
+                throw_err("File changed while copying", fname);
+            }
+
+            FileWriteAt(fd, std::string_view(buf.data(), n), done);
+            done += n;
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd)) {
+        throw_err("close()", fname);
+    }
+}
+
+struct file_id
+FileId(const std::string &fname)
+{
+    struct stat st;
+
+    if (stat(fname.c_str(), &st)) {
+        throw_err("stat()", fname);
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        throw_err("!is_regular_file(fname)", fname);
+    }
+
+    return { static_cast<uint64_t>(st.st_dev),
+             static_cast<uint64_t>(st.st_ino),
+             static_cast<uint64_t>(st.st_size),
+             st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec,
+             st.st_ctim.tv_sec * 1000000000ull + st.st_ctim.tv_nsec };
+}
+
+bool
+operator==(const struct file_id &a, const struct file_id &b)
+{
+    return a.dev == b.dev && a.ino == b.ino && a.sz == b.sz && a.mtime_ns == b.mtime_ns &&
+           a.ctime_ns == b.ctime_ns;
+}
+
+bool
+FileIdSettled(const struct file_id &id, uint64_t at_ns)
+{
+    return std::max(id.mtime_ns, id.ctime_ns) + FILE_ID_SETTLE_NS < at_ns;
+}
+
+uint64_t
+FileClockNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+FileMap::FileMap(const std::string &fname)
+    : FileMap(fname, 0, UINT64_MAX)
+{
+}
+
+FileMap::FileMap(const std::string &fname, uint64_t off, uint64_t sz)
+{
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        throw_err("open()", fname);
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        throw_err("!is_regular_file(fname)", fname);
+    }
+
+    uint64_t file_sz = st.st_size;
+
+    if (sz == UINT64_MAX && off <= file_sz) {
+        sz = file_sz - off;
+    }
+
+    if (off > file_sz || sz > file_sz - off) {
+        close(fd);
+        throw_err("Out of file", fname + '@' + std::to_string(off) + '+' + std::to_string(sz));
+    }
+
+    this->map_sz = sz;
+
+    // mmap() refuses zero length, an empty file is an empty view
+    if (this->map_sz) {
+        // mmap() wants a page aligned offset, the view starts past the pad
+        const uint64_t page = sysconf(_SC_PAGESIZE);
+        this->map_pad       = off & (page - 1);
+
+        void *p = mmap(
+            nullptr, this->map_sz + this->map_pad, PROT_READ, MAP_PRIVATE, fd, off - this->map_pad);
+
+        if (p == MAP_FAILED) {
+            close(fd);
+            throw_err("mmap()", fname);
+        }
+
+        this->map_data = static_cast<const char *>(p) + this->map_pad;
+    }
+
+    close(fd);
+}
+
+FileMap::~FileMap()
+{
+    if (this->map_data) {
+        munmap(const_cast<char *>(this->map_data) - this->map_pad, this->map_sz + this->map_pad);
+    }
+}
+
+FileMap::FileMap(FileMap &&other) noexcept
+    : map_data(other.map_data)
+    , map_sz(other.map_sz)
+    , map_pad(other.map_pad)
+{
+    other.map_data = nullptr;
+    other.map_sz   = 0;
+    other.map_pad  = 0;
+}
+
+FileMap &
+FileMap::operator=(FileMap &&other) noexcept
+{
+    if (this != &other) {
+        this->~FileMap();
+
+        this->map_data = other.map_data;
+        this->map_sz   = other.map_sz;
+        this->map_pad  = other.map_pad;
+
+        other.map_data = nullptr;
+        other.map_sz   = 0;
+        other.map_pad  = 0;
+    }
+
+    return *this;
+}
+
+bool
+FileMap::Contains(size_t off, size_t sz) const
+{
+    return off <= this->map_sz && sz <= this->map_sz - off;
+}
+
+std::string_view
+FileMap::View(size_t off, size_t sz) const
+{
+    if (!this->Contains(off, sz)) {
+        throw_err("Out of mapping", std::to_string(off) + '+' + std::to_string(sz));
+    }
+
+    return std::string_view(this->map_data + off, sz);
+}
+
+void
+FileMap::Advise(int advice) const
+{
+    this->Advise(0, this->map_sz, advice);
+}
+
+void
+FileMap::Advise(size_t off, size_t sz, int advice) const
+{
+    // madvise() wants a page aligned start, a range mapping may not begin on one
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    if (this->map_data && sz && this->Contains(off, sz)) {
+        auto start      = reinterpret_cast<uintptr_t>(this->map_data) + off;
+        auto start_page = start & ~(page - 1);
+
+        madvise(reinterpret_cast<void *>(start_page), sz + start - start_page, advice);
+    }
+}
+
+void
+FileMap::Prefetch() const
+{
+    // Touch every page so the image is read from disk now
+    volatile char sink = 0;
+    const size_t page  = sysconf(_SC_PAGESIZE);
+
+    this->Advise(MADV_WILLNEED);
+
+    for (size_t off = 0; off < this->map_sz; off += page) {
+        sink = sink ^ this->map_data[off];
+    }
+}
@@ -1,8 +1,15 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <vector>
 #include <fstream>
+#include <functional>
+#include <condition_variable>
+#include <string_view>
 #include <unistd.h>
 
 #define throw_err(err_expr, err_append)                                                  \
@@ -25,12 +32,232 @@ BSWAP32(uint32_t x)
             ((x & 0x0000FF00u) << 8) | ((x & 0x000000FFu) << 24));
 }
 
+// Fixed buffer size for streaming item payloads
+constexpr size_t IO_CHUNK_SZ = 1 << 20;
+
 void usage(std::initializer_list<std::string> example,
            std::initializer_list<std::string> help);
 
+// Run fn(0) ... fn(count - 1) on up to threads workers (0 - all cores)
+void ParallelFor(size_t count, size_t threads, const std::function<void(size_t)> &fn);
+// Same, fn(i, worker) also gets the index of the worker it runs on
+size_t ParallelWorkers(size_t count, size_t threads);
+void ParallelFor(size_t count,
+                 size_t threads,
+                 const std::function<void(size_t, size_t)> &fn);
+
+// Counting semaphore, C++17 has none. BasicLockable, so std::lock_guard works
+class Semaphore {
+
+  private:
+    std::mutex count_lock;
+    std::condition_variable cv;
+    size_t count;
+
+  public:
+    explicit Semaphore(size_t n)
+        : count(n)
+    {
+    }
+
+    void lock();
+    void unlock();
+};
+
+std::string JsonEscape(const std::string &str);
+
+// Per-phase time and byte counters for --stats. Off by default: a disabled
+// StatScope is one relaxed load, no clock read. Phases nest and time is summed
+// over threads, so rows overlap and do not add up to the wall time. read_flash
+// is the header and items table, payloads page in under whoever touches them.
+enum STAT_PHASE {
+    STAT_FILE_READ,
+    STAT_FILE_WRITE,
+    STAT_FILE_COPY,
+    STAT_FILE_CLONE,
+    STAT_READ_FLASH,
+    STAT_UNPACK,
+    STAT_PACK,
+    STAT_WRITE_FLASH,
+    STAT_CRC32,
+    STAT_SHA256,
+    STAT_RSA_SIGN,
+    STAT_RSA_VERIFY,
+    STAT_INFLATE,
+    STAT_PHASE_MAX
+};
+
+// getopt_long() values of long only options, out of the range of short options
+constexpr int OPT_STATS    = 0x100;
+constexpr int OPT_CACHE    = 0x101;
+constexpr int OPT_NO_CACHE = 0x102;
+
+extern std::atomic<bool> stats_enabled;
+
+inline bool
+StatsEnabled()
+{
+    return stats_enabled.load(std::memory_order_relaxed);
+}
+
+void StatsEnable();
+void StatsAdd(enum STAT_PHASE phase, uint64_t ns, uint64_t bytes);
+void StatsPrint(std::ostream &os, bool json);
+
+class StatScope {
+
+  private:
+    enum STAT_PHASE phase;
+    uint64_t bytes = 0;
+    std::chrono::steady_clock::time_point t_start;
+    bool active;
+
+  public:
+    explicit StatScope(enum STAT_PHASE stat_phase, uint64_t stat_bytes = 0)
+        : phase(stat_phase)
+        , bytes(stat_bytes)
+        , active(StatsEnabled())
+    {
+        if (this->active) {
+            this->t_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StatScope()
+    {
+        if (this->active) {
+            auto t = std::chrono::steady_clock::now() - this->t_start;
+            StatsAdd(this->phase,
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(t).count(),
+                     this->bytes);
+        }
+    }
+
+    StatScope(const StatScope &) = delete;
+    StatScope &operator=(const StatScope &) = delete;
+
+    void
+    AddBytes(uint64_t n)
+    {
+        this->bytes += n;
+    }
+};
+
 std::string FilePathOnFS(const std::string &dir, const std::string &base);
 std::fstream FileOpen(const std::string &fname, std::ios::openmode m);
 std::string FileRead(std::fstream fd);
 std::string FileRead(const std::string &fname, std::ios::openmode m);
+void FileWrite(const std::string &fname,
+               std::string_view data,
+               const std::function<void(std::string_view)> &chunk_cb = nullptr);
+// One pread() of up to sz bytes, 0 at the end of the file
+size_t FileReadAt(int fd, char *buf, size_t sz, uint64_t off);
+void FileWriteAt(int fd, std::string_view data, uint64_t off);
+// Chunks back to back from off, pwritev() of up to IOV_MAX chunks per call
+void FileWriteVAt(int fd, const std::vector<std::string_view> &chunks, uint64_t off);
+// Unique name next to fname, for a file renamed over it once complete
+std::string FileTempPath(const std::string &fname);
+// Made by FileTempPath(), possibly still being written
+bool FileTempName(const std::string &fname);
+
+// Copies sz bytes of fname to fd at off. With chunk_cb the data goes through
+// user space so chunk_cb sees it, without it copy_file_range() is tried first.
+void FileCopyRange(const std::string &fname,
+                   int fd_out,
+                   uint64_t off_out,
+                   uint64_t sz,
+                   const std::function<void(std::string_view)> &chunk_cb = nullptr);
+
+// Writes sz bytes of fd_in at off_in to a new fname without passing them through
+// user space. The block aligned part is a reflink (FICLONERANGE) where the
+// filesystem has them, the rest goes through copy_file_range().
+void FileCloneRange(int fd_in, uint64_t off_in, uint64_t sz, const std::string &fname);
+
+// Output file built under FileTempPath() and renamed over fname by Commit(), so
+// readers never see it half written. Gone again if never committed. fname becomes
+// a new inode: it keeps the permission bits, not the owner or other hardlinks,
+// and a symlink at fname is replaced rather than written through.
+class FileAtomic {
+
+  private:
+    int fd = -1;
+    std::string path;
+    std::string path_tmp;
+
+  public:
+    // sz is preallocated: one extent where the FS can, ENOSPC before any write
+    FileAtomic(const std::string &fname, uint64_t sz);
+    ~FileAtomic();
+
+    FileAtomic(const FileAtomic &) = delete;
+    FileAtomic &operator=(const FileAtomic &) = delete;
+
+    int
+    Fd() const
+    {
+        return this->fd;
+    }
+
+    void Commit();
+};
+
+// Identity of a file's content as seen by stat(). mtime can be set back by anyone
+// who can write the file, ctime cannot: any write moves it.
+struct file_id {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t sz;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+};
+
+// Longer than a timestamp tick: a write after a digest taken this long after the
+// last change always shows up as a new ctime
+constexpr uint64_t FILE_ID_SETTLE_NS = 2'000'000'000;
+
+struct file_id FileId(const std::string &fname);
+bool operator==(const struct file_id &a, const struct file_id &b);
+// A digest of the file taken at at_ns stays valid while its file_id matches
+bool FileIdSettled(const struct file_id &id, uint64_t at_ns);
+// Wall clock in ns, the clock file timestamps are taken from
+uint64_t FileClockNs();
+
+// Read-only mapping of a whole file or of a range of it, items are kept as views into it
+class FileMap {
+
+  private:
+    const char *map_data = nullptr;
+    size_t map_sz        = 0;
+    size_t map_pad       = 0; // From the page aligned start of the mapping to map_data
+
+  public:
+    FileMap() = default;
+    explicit FileMap(const std::string &fname);
+    FileMap(const std::string &fname, uint64_t off, uint64_t sz);
+    ~FileMap();
+
+    FileMap(const FileMap &) = delete;
+    FileMap &operator=(const FileMap &) = delete;
+    FileMap(FileMap &&other) noexcept;
+    FileMap &operator=(FileMap &&other) noexcept;
+
+    const char *
+    data() const
+    {
+        return this->map_data;
+    }
+
+    size_t
+    size() const
+    {
+        return this->map_sz;
+    }
+
+    bool Contains(size_t off, size_t sz) const;
+    std::string_view View(size_t off, size_t sz) const;
+    void Advise(int advice) const;
+    void Advise(size_t off, size_t sz, int advice) const;
+    void Prefetch() const;
+};
 
 #endif // UTIL_H
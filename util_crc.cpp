@@ -0,0 +1,373 @@
+#include <array>
+#include <atomic>
+#include <random>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+#include "util.hpp"
+#include "util_crc.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL
+#endif
+
+using crc32_fn = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+// Longest buffer crc32_impl_check() compares, a few 64 byte folding blocks and more
+constexpr size_t CRC32_CHECK_SZ = 4096;
+
+static uint32_t
+crc32_zlib(uint32_t crc, const uint8_t *p, size_t sz)
+{
+    // zlib crc32() takes uInt length
+    while (sz) {
+        uInt n = std::min<size_t>(sz, 1u << 30);
+        crc    = crc32(crc, p, n);
+        p += n;
+        sz -= n;
+    }
+    return crc;
+}
+
+struct crc32_tables {
+    uint32_t t[16][256];
+
+    crc32_tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c >> 1) ^ (c & 1 ? 0xEDB88320u : 0);
+            }
+            t[0][i] = c;
+        }
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 16; ++k) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+static const crc32_tables &
+crc32_tables_get()
+{
+    static const crc32_tables tables;
+    return tables;
+}
+
+static inline uint32_t
+load_le32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = BSWAP32(v);
+#endif
+    return v;
+}
+
+static uint32_t
+crc32_tail(uint32_t c, const uint8_t *p, size_t sz)
+{
+    auto &t = crc32_tables_get().t;
+
+    while (sz--) {
+        c = (c >> 8) ^ t[0][(c ^ *p++) & 0xFF];
+    }
+    return c;
+}
+
+static uint32_t
+crc32_slice16(uint32_t crc, const uint8_t *p, size_t sz)
+{
+    auto &t    = crc32_tables_get().t;
+    uint32_t c = ~crc;
+
+    for (; sz >= 16; sz -= 16, p += 16) {
+        uint32_t a = load_le32(p) ^ c;
+        uint32_t b = load_le32(p + 4);
+        uint32_t d = load_le32(p + 8);
+        uint32_t e = load_le32(p + 12);
+
+        c = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^
+            t[12][a >> 24] ^ t[11][b & 0xFF] ^ t[10][(b >> 8) & 0xFF] ^
+            t[9][(b >> 16) & 0xFF] ^ t[8][b >> 24] ^ t[7][d & 0xFF] ^
+            t[6][(d >> 8) & 0xFF] ^ t[5][(d >> 16) & 0xFF] ^ t[4][d >> 24] ^
+            t[3][e & 0xFF] ^ t[2][(e >> 8) & 0xFF] ^ t[1][(e >> 16) & 0xFF] ^
+            t[0][e >> 24];
+    }
+
+    return ~crc32_tail(c, p, sz);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+// Folding with carry-less multiply, constants from Intel
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_pclmul_fold(uint32_t c, const uint8_t *p, size_t sz)
+{
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    // sz >= 64 and a multiple of 16
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+
+    p += 64;
+    sz -= 64;
+
+    // Fold four lanes of 128 bits in parallel
+    for (; sz >= 64; sz -= 64, p += 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+        y6 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+        y7 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+        y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    }
+
+    // Fold four lanes into one
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+
+    for (__m128i xn : { x2, x3, x4 }) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, xn), x5);
+    }
+
+    for (; sz >= 16; sz -= 16, p += 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *p, size_t sz)
+{
+    if (sz < 64) {
+        return crc32_slice16(crc, p, sz);
+    }
+
+    size_t fold_sz = sz & ~size_t(15);
+    uint32_t c     = crc32_pclmul_fold(~crc, p, fold_sz);
+
+    return ~crc32_tail(c, p + fold_sz, sz - fold_sz);
+}
+#endif // CRC32_HAVE_PCLMUL
+
+static const struct {
+    const char *name;
+    crc32_fn fn;
+} crc32_impls[CRC32_IMPL_MAX] = {
+    { "zlib", crc32_zlib },       // CRC32_ZLIB
+    { "slice16", crc32_slice16 }, // CRC32_SLICE16
+#ifdef CRC32_HAVE_PCLMUL
+    { "pclmul", crc32_pclmul }, // CRC32_PCLMUL
+#else
+    { "pclmul", nullptr },
+#endif
+};
+
+static std::atomic<int> crc32_impl_active = -1;
+
+const char *
+crc32_impl_name(enum CRC32_IMPL impl)
+{
+    return crc32_impls[impl].name;
+}
+
+static bool
+crc32_impl_cpu(enum CRC32_IMPL impl)
+{
+    if (!crc32_impls[impl].fn) {
+        return false;
+    }
+
+#ifdef CRC32_HAVE_PCLMUL
+    if (impl == CRC32_PCLMUL) {
+        return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+#endif
+
+    return true;
+}
+
+bool
+crc32_impl_check(enum CRC32_IMPL impl)
+{
+    if (!crc32_impl_cpu(impl)) {
+        return false;
+    }
+
+    // Fixed seed: a failure shows up the same way on every run
+    std::mt19937 rng(0x48574E50);
+    std::vector<uint8_t> buf(CRC32_CHECK_SZ + 16);
+
+    std::generate(buf.begin(), buf.end(), [&]() { return uint8_t(rng()); });
+
+    // Every length around the folding and tail thresholds, then random ones,
+    // each at every alignment within 16 bytes and from a random running CRC32
+    for (size_t i = 0; i < 256 + 256; ++i) {
+        size_t sz  = i < 256 ? i : rng() % CRC32_CHECK_SZ;
+        size_t off = i % 16;
+        uint32_t c = rng();
+
+        if (crc32_impls[impl].fn(c, buf.data() + off, sz) != crc32_zlib(c, buf.data() + off, sz)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+crc32_impl_supported(enum CRC32_IMPL impl)
+{
+    // Checked against zlib once per process, an impl that disagrees is never used
+    static const auto impls_ok = []() {
+        std::array<bool, CRC32_IMPL_MAX> ok;
+
+        for (int i = 0; i < CRC32_IMPL_MAX; ++i) {
+            ok[i] = i == CRC32_ZLIB || crc32_impl_check(static_cast<enum CRC32_IMPL>(i));
+        }
+
+        return ok;
+    }();
+
+    return impls_ok[impl];
+}
+
+enum CRC32_IMPL
+crc32_impl_get()
+{
+    int impl = crc32_impl_active.load(std::memory_order_relaxed);
+
+    if (impl < 0) {
+        impl = crc32_impl_supported(CRC32_PCLMUL)    ? CRC32_PCLMUL
+               : crc32_impl_supported(CRC32_SLICE16) ? CRC32_SLICE16
+                                                     : CRC32_ZLIB;
+        crc32_impl_active.store(impl, std::memory_order_relaxed);
+    }
+
+    return static_cast<enum CRC32_IMPL>(impl);
+}
+
+void
+crc32_impl_set(enum CRC32_IMPL impl)
+{
+    if (!crc32_impl_supported(impl)) {
+        throw_err("!crc32_impl_supported()", crc32_impl_name(impl));
+    }
+
+    crc32_impl_active.store(impl, std::memory_order_relaxed);
+}
+
+uint32_t
+crc32_update(enum CRC32_IMPL impl, uint32_t crc, const void *buf, size_t sz)
+{
+    return crc32_impls[impl].fn(crc, static_cast<const uint8_t *>(buf), sz);
+}
+
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t sz)
+{
+    StatScope stat(STAT_CRC32, sz);
+
+    return crc32_update(crc32_impl_get(), crc, buf, sz);
+}
+
+std::vector<uint32_t>
+crc32_parallel(const std::vector<std::string_view> &bufs, size_t threads)
+{
+    struct crc_chunk {
+        size_t buf_ix;
+        size_t off;
+        size_t sz;
+        uint32_t crc32;
+    };
+
+    StatScope stat(STAT_CRC32);
+
+    // Small buffers are one chunk each, so they are spread over workers as well
+    std::vector<struct crc_chunk> chunks;
+
+    for (size_t i = 0; i < bufs.size(); ++i) {
+        size_t off = 0;
+
+        stat.AddBytes(bufs[i].size());
+
+        do {
+            size_t sz = std::min(bufs[i].size() - off, CRC32_CHUNK_SZ);
+            chunks.push_back({ i, off, sz, 0 });
+            off += sz;
+        } while (off < bufs[i].size());
+    }
+
+    // Counted once above, not per chunk
+    auto impl = crc32_impl_get();
+
+    ParallelFor(chunks.size(), threads, [&](size_t ix) {
+        auto &c = chunks[ix];
+        c.crc32 = crc32_update(impl, 0, bufs[c.buf_ix].data() + c.off, c.sz);
+    });
+
+    std::vector<uint32_t> crcs(bufs.size(), 0);
+
+    for (auto &c : chunks) {
+        crcs[c.buf_ix] = crc32_combine(crcs[c.buf_ix], c.crc32, c.sz);
+    }
+
+    return crcs;
+}
@@ -0,0 +1,32 @@
+#ifndef CRC_UTIL_H
+#define CRC_UTIL_H
+
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+// Large buffers are split into chunks of this size for the worker pool
+constexpr size_t CRC32_CHUNK_SZ = 1 << 20;
+
+enum CRC32_IMPL { CRC32_ZLIB, CRC32_SLICE16, CRC32_PCLMUL, CRC32_IMPL_MAX };
+
+const char *crc32_impl_name(enum CRC32_IMPL impl);
+// The CPU has it and it matches zlib crc32() (checked once, see crc32_impl_check())
+bool crc32_impl_supported(enum CRC32_IMPL impl);
+// impl against zlib crc32() over lengths 0-4 KiB, every alignment within 16 bytes
+// and random starting CRC32s
+bool crc32_impl_check(enum CRC32_IMPL impl);
+
+// Fastest supported backend is picked on first use, crc32_impl_set() overrides it
+enum CRC32_IMPL crc32_impl_get();
+void crc32_impl_set(enum CRC32_IMPL impl);
+
+// Same contract as zlib crc32(): crc == 0 starts a new checksum. Counted as crc32
+// by --stats, the impl overload is not.
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t sz);
+uint32_t crc32_update(enum CRC32_IMPL impl, uint32_t crc, const void *buf, size_t sz);
+
+std::vector<uint32_t> crc32_parallel(const std::vector<std::string_view> &bufs,
+                                     size_t threads);
+
+#endif // CRC_UTIL_H
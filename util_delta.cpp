@@ -0,0 +1,363 @@
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util.hpp"
+#include "util_crc.hpp"
+#include "util_delta.hpp"
+
+// Merges adjacent segments and streams them out
+class DeltaWriter {
+
+  private:
+    std::ostream &os;
+    struct delta_seg seg = {};
+    std::string literal;
+
+  public:
+    struct delta_stats stats = {};
+
+    explicit DeltaWriter(std::ostream &out)
+        : os(out)
+    {
+    }
+
+    void
+    Flush()
+    {
+        if (this->seg.type == DELTA_SEG::SEG_LITERAL) {
+            uLongf z_sz = compressBound(this->literal.size());
+            std::string z_buf(z_sz, '\0');
+
+            if (compress2(reinterpret_cast<Bytef *>(z_buf.data()),
+                          &z_sz,
+                          reinterpret_cast<const Bytef *>(this->literal.data()),
+                          this->literal.size(),
+                          Z_BEST_COMPRESSION) != Z_OK) {
+                throw_err("!compress2()", "Delta literal");
+            }
+
+            this->seg.src = z_sz;
+            this->os.write(reinterpret_cast<const char *>(&this->seg), sizeof(delta_seg));
+            this->os.write(z_buf.data(), z_sz);
+            this->literal.clear();
+        } else if (this->seg.type == DELTA_SEG::SEG_COPY) {
+            this->os.write(reinterpret_cast<const char *>(&this->seg), sizeof(delta_seg));
+        }
+
+        if (!this->os) {
+            throw_err("!os.write", "Delta segment");
+        }
+
+        this->seg = {};
+    }
+
+    void
+    Copy(uint64_t src, uint64_t sz)
+    {
+        if (this->seg.type != DELTA_SEG::SEG_COPY || this->seg.src + this->seg.sz != src) {
+            this->Flush();
+            this->seg = { DELTA_SEG::SEG_COPY, 0, 0, src };
+        }
+
+        this->seg.sz += sz;
+        this->stats.copy_sz += sz;
+    }
+
+    void
+    Literal(std::string_view raw)
+    {
+        this->stats.literal_sz += raw.size();
+
+        while (!raw.empty()) {
+            // Bounded, so apply never holds more than one chunk
+            if (this->seg.type != DELTA_SEG::SEG_LITERAL ||
+                this->literal.size() == IO_CHUNK_SZ) {
+                this->Flush();
+                this->seg = { DELTA_SEG::SEG_LITERAL, 0, 0, 0 };
+            }
+
+            auto part = raw.substr(0, IO_CHUNK_SZ - this->literal.size());
+
+            this->literal.append(part);
+            this->seg.sz += part.size();
+            raw.remove_prefix(part.size());
+        }
+    }
+
+    void
+    End()
+    {
+        this->Flush();
+        this->seg = { DELTA_SEG::SEG_END, 0, 0, 0 };
+        this->os.write(reinterpret_cast<const char *>(&this->seg), sizeof(delta_seg));
+
+        if (!this->os.flush()) {
+            throw_err("!os.flush", "Delta end");
+        }
+    }
+};
+
+// rsync style weak checksum of a block, rolled one byte at a time
+class WeakSum {
+
+  private:
+    uint32_t a = 0, b = 0, len = 0;
+
+  public:
+    WeakSum(const uint8_t *p, uint32_t sz)
+        : len(sz)
+    {
+        for (uint32_t i = 0; i < sz; ++i) {
+            this->a += p[i];
+            this->b += (sz - i) * p[i];
+        }
+    }
+
+    void
+    Roll(uint8_t out, uint8_t in)
+    {
+        this->a += in - out;
+        this->b += this->a - this->len * out;
+    }
+
+    uint32_t
+    Get() const
+    {
+        return (this->a & 0xFFFF) | (this->b << 16);
+    }
+};
+
+struct delta_stats
+DeltaMake(const std::string &path_old,
+          const std::string &path_new,
+          std::ostream &os,
+          uint32_t block_sz)
+{
+    Firmware fw_old, fw_new;
+
+    // Both images stay mapped, nothing is copied to the heap
+    fw_old.ReadFlashFromFS(path_old);
+    fw_new.ReadFlashFromFS(path_new);
+
+    auto &map_old   = fw_old.getFlashMap();
+    auto &map_new   = fw_new.getFlashMap();
+    auto &items_old = fw_old.getItemsHeader();
+    auto &items_new = fw_new.getItemsHeader();
+
+    std::unordered_map<std::string, size_t> items_old_ix;
+
+    // Item-relative aligned blocks of the old image, found at any offset
+    // of the new one. The bitmap rejects most misses without a lookup.
+    constexpr uint32_t weak_mask = (1u << 24) - 1;
+    std::unordered_multimap<uint32_t, uint64_t> blocks_old;
+    std::vector<bool> blocks_seen(weak_mask + 1, false);
+
+    for (size_t i = 0; i < items_old.size(); ++i) {
+        auto &hi  = items_old.at(i);
+        auto &raw = fw_old.getItemsRaw().at(i);
+
+        items_old_ix.emplace(hi.item, i);
+
+        for (size_t off = 0; off + block_sz <= raw.size(); off += block_sz) {
+            auto p = reinterpret_cast<const uint8_t *>(raw.data()) + off;
+            auto w = WeakSum(p, block_sz).Get();
+
+            blocks_old.emplace(w, hi.data_off + off);
+            blocks_seen[w & weak_mask] = true;
+        }
+    }
+
+    auto block_find = [&](uint32_t w, const char *p) -> int64_t {
+        if (!blocks_seen[w & weak_mask]) {
+            return -1;
+        }
+
+        auto range = blocks_old.equal_range(w);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (!std::memcmp(map_old.data() + it->second, p, block_sz)) {
+                return it->second;
+            }
+        }
+        return -1;
+    };
+
+    struct delta_header dh = {};
+    dh.magic               = DELTA_MAGIC;
+    dh.version             = DELTA_VERSION;
+    dh.new_sz              = map_new.size();
+    dh.new_crc32           = crc32_update(0, map_new.data(), map_new.size());
+    dh.block_sz            = block_sz;
+
+    if (!os.write(reinterpret_cast<const char *>(&dh), sizeof(delta_header))) {
+        throw_err("!os.write", "Delta header");
+    }
+
+    DeltaWriter dw(os);
+
+    // New items in file order, gaps and the header area go as literals
+    std::vector<size_t> order(items_new.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order.at(i) = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return items_new.at(a).data_off < items_new.at(b).data_off;
+    });
+
+    uint64_t cursor = 0;
+
+    for (size_t i : order) {
+        auto &hi  = items_new.at(i);
+        auto &raw = fw_new.getItemsRaw().at(i);
+
+        if (hi.data_off < cursor) {
+            continue; // Overlaps bytes already emitted
+        }
+
+        dw.Literal(map_new.View(cursor, hi.data_off - cursor));
+        cursor = hi.data_off + hi.data_sz;
+
+        // Same path and CRC32: the whole item by reference
+        auto it_old = items_old_ix.find(hi.item);
+
+        if (it_old != items_old_ix.end()) {
+            auto &hi_old  = items_old.at(it_old->second);
+            auto &raw_old = fw_old.getItemsRaw().at(it_old->second);
+
+            if (hi_old.item_crc32 == hi.item_crc32 && raw_old == raw) {
+                dw.Copy(hi_old.data_off, hi.data_sz);
+                dw.stats.items_ref += 1;
+                continue;
+            }
+        }
+
+        dw.stats.items_diff += 1;
+
+        auto p         = reinterpret_cast<const uint8_t *>(raw.data());
+        size_t pos     = 0;
+        size_t lit_off = 0;
+
+        while (pos + block_sz <= raw.size()) {
+            WeakSum w(p + pos, block_sz);
+
+            for (;;) {
+                int64_t src = block_find(w.Get(), raw.data() + pos);
+
+                if (src >= 0) {
+                    dw.Literal(raw.substr(lit_off, pos - lit_off));
+                    dw.Copy(src, block_sz);
+                    pos += block_sz;
+                    lit_off = pos;
+                    break;
+                }
+
+                if (pos + block_sz >= raw.size()) {
+                    pos = raw.size();
+                    break;
+                }
+
+                w.Roll(p[pos], p[pos + block_sz]);
+                pos += 1;
+            }
+        }
+
+        dw.Literal(raw.substr(lit_off));
+    }
+
+    dw.Literal(map_new.View(cursor, map_new.size() - cursor));
+    dw.End();
+
+    return dw.stats;
+}
+
+struct crc32_report
+DeltaApply(const std::string &path_old, std::istream &is, const std::string &path_new)
+{
+    struct delta_header dh;
+
+    if (!is.read(reinterpret_cast<char *>(&dh), sizeof(delta_header)) ||
+        dh.magic != DELTA_MAGIC || dh.version != DELTA_VERSION) {
+        throw_err("Delta header corrupted", "magic/version");
+    }
+
+    struct stat st_old, st_new;
+
+    // Rebuilding over the old image would read it while it is replaced
+    if (!stat(path_old.c_str(), &st_old) && !stat(path_new.c_str(), &st_new) &&
+        st_old.st_dev == st_new.st_dev && st_old.st_ino == st_new.st_ino) {
+        throw_err("Output is the old image", path_new);
+    }
+
+    errno = 0;
+
+    FileMap map_old(path_old);
+    map_old.Advise(MADV_RANDOM);
+
+    // Renamed over path_new only once the result matches, a failure leaves it as it was
+    FileAtomic file_new(path_new, dh.new_sz);
+
+    uint64_t off       = 0;
+    uint32_t new_crc32 = 0;
+    std::string literal, z_buf;
+
+    auto emit = [&](std::string_view raw) {
+        new_crc32 = crc32_update(new_crc32, raw.data(), raw.size());
+        FileWriteAt(file_new.Fd(), raw, off);
+        off += raw.size();
+    };
+
+    for (struct delta_seg seg;;) {
+
+        if (!is.read(reinterpret_cast<char *>(&seg), sizeof(delta_seg))) {
+            throw_err("Delta segment corrupted", std::to_string(off));
+        }
+
+        if (seg.type == DELTA_SEG::SEG_END) {
+            break;
+        }
+
+        if (seg.sz > dh.new_sz - off) {
+            throw_err("Delta segment past the end", std::to_string(off));
+        }
+
+        if (seg.type == DELTA_SEG::SEG_COPY) {
+            emit(map_old.View(seg.src, seg.sz));
+        } else if (seg.type == DELTA_SEG::SEG_LITERAL && seg.sz <= IO_CHUNK_SZ &&
+                   seg.src <= compressBound(IO_CHUNK_SZ)) {
+            z_buf.resize(seg.src);
+            literal.resize(seg.sz);
+
+            uLongf raw_sz = literal.size();
+
+            if (!is.read(z_buf.data(), z_buf.size()) ||
+                uncompress(reinterpret_cast<Bytef *>(literal.data()),
+                           &raw_sz,
+                           reinterpret_cast<const Bytef *>(z_buf.data()),
+                           z_buf.size()) != Z_OK ||
+                raw_sz != literal.size()) {
+                throw_err("Delta literal corrupted", std::to_string(off));
+            }
+
+            emit(literal);
+        } else {
+            throw_err("Delta segment type", std::to_string(seg.type));
+        }
+    }
+
+    if (off != dh.new_sz || new_crc32 != dh.new_crc32) {
+        throw_err("Delta result mismatch", "Wrong old image?");
+    }
+
+    file_new.Commit();
+
+    // Bit exact, now the firmware's own CRC32
+    Firmware fw_new;
+    fw_new.ReadFlashFromFS(path_new);
+
+    return fw_new.VerifyCRC32();
+}
@@ -0,0 +1,50 @@
+#ifndef DELTA_UTIL_H
+#define DELTA_UTIL_H
+
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include "util_hw.hpp"
+
+// Delta between two images: a header, then segments that rebuild the new
+// image front to back from ranges of the old image and (zlib) literals.
+enum DELTA_SEG { SEG_END, SEG_COPY, SEG_LITERAL };
+
+constexpr uint32_t DELTA_MAGIC   = 0x4c445748; // "HWDL"
+constexpr uint32_t DELTA_VERSION = 1;
+
+struct delta_header {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t new_sz;
+    uint32_t new_crc32;
+
+    uint32_t block_sz;
+};
+
+struct delta_seg {
+    uint32_t type;
+    uint32_t reserved;
+
+    uint64_t sz;  // Bytes of the new image
+    uint64_t src; // SEG_COPY: offset in the old image, SEG_LITERAL: stored size
+};
+
+struct delta_stats {
+    size_t items_ref;
+    size_t items_diff;
+    uint64_t copy_sz;
+    uint64_t literal_sz;
+};
+
+struct delta_stats DeltaMake(const std::string &path_old,
+                             const std::string &path_new,
+                             std::ostream &os,
+                             uint32_t block_sz);
+
+struct crc32_report DeltaApply(const std::string &path_old,
+                               std::istream &is,
+                               const std::string &path_new);
+
+#endif // DELTA_UTIL_H
@@ -0,0 +1,210 @@
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <algorithm>
+#include <filesystem>
+#include "util.hpp"
+#include "util_hw.hpp"
+#include "util_crc.hpp"
+#include "util_gen.hpp"
+
+static uint64_t
+splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+
+    return x ^ (x >> 31);
+}
+
+static uint64_t
+GenItemSeed(const struct gen_spec &spec, size_t i)
+{
+    return splitmix64(spec.seed ^ splitmix64(i));
+}
+
+uint64_t
+GenItemSize(const struct gen_spec &spec, size_t i)
+{
+    uint64_t lo = std::min(spec.item_sz_min, spec.item_sz_max);
+    uint64_t hi = spec.item_sz_max;
+    uint64_t r  = splitmix64(GenItemSeed(spec, i));
+
+    switch (spec.dist) {
+        case GEN_FIXED:
+            break;
+        case GEN_UNIFORM:
+            return lo + r % (hi - lo + 1);
+        case GEN_SKEWED: {
+            double u      = (r >> 11) * 0x1.0p-53;
+            double log_lo = std::log(double(std::max<uint64_t>(lo, 1)));
+            double log_hi = std::log(double(std::max<uint64_t>(hi, 1)));
+
+            return std::clamp<uint64_t>(std::exp(log_lo + u * (log_hi - log_lo)), lo, hi);
+        }
+    }
+
+    return hi;
+}
+
+// Each 4 KiB page: half random, half zero, so items compress like rootfs/kernel.
+// Stateless per 8 byte word, any range of an item is generated on its own.
+void
+GenFill(std::string &buf, uint64_t seed, uint64_t off)
+{
+    for (size_t i = 0; i < buf.size();) {
+        uint64_t pos  = off + i;
+        uint64_t word = pos % 4096 < 2048 ? splitmix64(seed ^ (pos / 8)) : 0;
+
+        size_t word_off = pos % 8;
+        size_t n        = std::min(8 - word_off, buf.size() - i);
+
+        std::memcpy(&buf[i], reinterpret_cast<const char *>(&word) + word_off, n);
+        i += n;
+    }
+}
+
+static std::string
+GenItemPath(const struct gen_spec &spec, size_t i)
+{
+    auto &section = spec.sections.at(i % spec.sections.size());
+
+    return "file:/gen/" + std::to_string(i) + "_" + section + ".bin";
+}
+
+static std::string
+GenItemList(const struct gen_spec &spec)
+{
+    if (!spec.item_counts || spec.sections.empty()) {
+        throw_err("Empty items on spec", "Count of items");
+    }
+
+    std::string prod_list, prod_base = "494|4B4|534|5D4|614|;COMMON|";
+
+    while (prod_list.size() < spec.prod_list_sz) {
+        prod_list += prod_base;
+    }
+
+    prod_list.resize(spec.prod_list_sz);
+
+    std::ostringstream item_list;
+
+    item_list << "0x504e5748\n";
+    item_list << prod_list.size() << ' ' << prod_list << '\n';
+
+    for (size_t i = 0; i < spec.item_counts; ++i) {
+        auto section = spec.sections.at(i % spec.sections.size()).substr(0, 15);
+
+        item_list << "+ " << i << ' ' << GenItemPath(spec, i) << ' ' << section << " NULL 0\n";
+    }
+
+    return item_list.str();
+}
+
+// Streams item i to fd at off, returns its CRC32
+static uint32_t
+GenItemWrite(const struct gen_spec &spec, size_t i, int fd, uint64_t off, uint64_t item_sz)
+{
+    thread_local std::string buf;
+
+    uint32_t item_crc32 = 0;
+    uint64_t seed       = GenItemSeed(spec, i);
+
+    for (uint64_t pos = 0; pos < item_sz; pos += buf.size()) {
+        buf.resize(std::min<uint64_t>(IO_CHUNK_SZ, item_sz - pos));
+        GenFill(buf, seed, pos);
+
+        item_crc32 = crc32_update(item_crc32, buf.data(), buf.size());
+        FileWriteAt(fd, buf, off + pos);
+    }
+
+    return item_crc32;
+}
+
+void
+GenImage(const struct gen_spec &spec, const std::string &path_fmw)
+{
+    Firmware fw = {};
+    fw.SetThreads(spec.threads);
+    fw.SetHeaderSizeOld(spec.hdr_sz_old);
+
+    // Header and items table go through the same parser as hw_fmw -p
+    std::stringstream list_metadata(GenItemList(spec));
+
+    fw.ReadHeaderFromFS(list_metadata);
+
+    for (std::string line; std::getline(list_metadata, line);) {
+
+        if (line.size() <= 2 || line.front() != '+') {
+            continue;
+        }
+
+        line.erase(0, 2);
+
+        struct huawei_item hi = {};
+        fw.PresetItemHeader(hi, line);
+
+        uint64_t item_sz = GenItemSize(spec, hi.iter);
+
+        if (item_sz > UINT32_MAX) {
+            throw_err("Item over 4 GiB", hi.item);
+        }
+
+        hi.data_sz = item_sz;
+        fw.AddItemHeader(hi);
+    }
+
+    fw.PresetLayout();
+
+    fw.PackStreamToFS(path_fmw, [&](size_t i, size_t, int fd, uint32_t &item_crc32) {
+        auto &hi = fw.getItemsHeader().at(i);
+
+        item_crc32 = GenItemWrite(spec, i, fd, hi.data_off, hi.data_sz);
+    });
+}
+
+std::string
+GenTree(const struct gen_spec &spec, const std::string &path_items)
+{
+    auto item_list = GenItemList(spec);
+
+    std::ostringstream sig_item_list;
+    std::vector<std::string> items_path;
+
+    for (size_t i = 0; i < spec.item_counts; ++i) {
+        auto item = GenItemPath(spec, i);
+
+        sig_item_list << "+ " << item << '\n';
+        items_path.push_back(FilePathOnFS(path_items, item.substr(item.find(':') + 1)));
+    }
+
+    std::filesystem::create_directories(std::filesystem::path(items_path.front()).parent_path());
+
+    ParallelFor(items_path.size(), spec.threads, [&](size_t i) {
+        auto &item_path = items_path.at(i);
+
+        int fd = open(item_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+        if (fd < 0) {
+            throw_err("open()", item_path);
+        }
+
+        try {
+            GenItemWrite(spec, i, fd, 0, GenItemSize(spec, i));
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+
+        if (close(fd)) {
+            throw_err("close()", item_path);
+        }
+    });
+
+    FileWrite(FilePathOnFS(path_items, "/item_list.txt"), item_list);
+    FileWrite(FilePathOnFS(path_items, "/sig_item_list.txt"), sig_item_list.str());
+
+    return item_list;
+}
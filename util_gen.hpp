@@ -0,0 +1,36 @@
+#ifndef GEN_UTIL_H
+#define GEN_UTIL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Size of each item: all item_sz_max, uniform in [min, max], or log-uniform
+// in [min, max] (many small items, a few large ones, like real images)
+enum GEN_DIST { GEN_FIXED, GEN_UNIFORM, GEN_SKEWED };
+
+struct gen_spec {
+    size_t item_counts;
+    uint64_t item_sz_min;
+    uint64_t item_sz_max;
+    enum GEN_DIST dist;
+
+    std::vector<std::string> sections; // Cycled over the items
+    size_t prod_list_sz;
+    bool hdr_sz_old;
+
+    uint64_t seed;
+    size_t threads;
+};
+
+// Same spec and seed give the same bytes
+uint64_t GenItemSize(const struct gen_spec &spec, size_t i);
+void GenFill(std::string &buf, uint64_t seed, uint64_t off);
+
+// HWNP image written straight to disk in IO_CHUNK_SZ pieces, any size up to 4 GiB
+void GenImage(const struct gen_spec &spec, const std::string &path_fmw);
+
+// Item tree as left by hw_fmw -u: item_list.txt, sig_item_list.txt and files
+std::string GenTree(const struct gen_spec &spec, const std::string &path_items);
+
+#endif // GEN_UTIL_H
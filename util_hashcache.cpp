@@ -0,0 +1,310 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "util.hpp"
+#include "util_crc.hpp"
+#include "util_rsa.hpp"
+#include "util_hashcache.hpp"
+
+constexpr char HASH_CACHE_MAGIC[8]    = "HWHASHC";
+constexpr uint32_t HASH_CACHE_VERSION = 2;
+
+struct hash_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+// Followed by path_sz bytes of absolute path, the last record of a path wins
+struct hash_cache_record {
+    struct file_id id;
+    char sha256[64]; // Hex digest, no NUL
+    uint32_t crc32;
+    uint32_t path_sz;
+};
+
+static void
+RecordAppend(std::string &buf,
+             const std::string &path,
+             const struct file_id &id,
+             const struct file_digest &digest)
+{
+    struct hash_cache_record rec = {};
+
+    rec.id      = id;
+    rec.crc32   = digest.crc32;
+    rec.path_sz = path.size();
+    std::memcpy(rec.sha256, digest.sha256.data(), sizeof(rec.sha256));
+
+    buf.append(reinterpret_cast<const char *>(&rec), sizeof(rec));
+    buf.append(path);
+}
+
+struct file_digest
+file_digest_read(const std::string &fname)
+{
+    uint32_t crc32 = 0;
+
+    auto sha256 = sha256_file(fname, [&](std::string_view chunk) {
+        crc32 = crc32_update(crc32, chunk.data(), chunk.size());
+    });
+
+    return { sha256, crc32 };
+}
+
+HashCache::HashCache(const std::string &path)
+    : path_cache(path)
+{
+    int fd = open(this->path_cache.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 && errno == ENOENT) {
+        return;
+    }
+
+    if (fd < 0) {
+        throw_err("open()", this->path_cache);
+    }
+
+    try {
+        // Nobody appends or compacts while it is read
+        if (flock(fd, LOCK_SH)) {
+            throw_err("flock()", this->path_cache);
+        }
+
+        this->Load(fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+void
+HashCache::Load(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st)) {
+        throw_err("fstat()", this->path_cache);
+    }
+
+    // Compacted by another job since: a new file, parsed from the start
+    if (st.st_ino != this->loaded_ino) {
+        this->loaded_ino = st.st_ino;
+        this->loaded_sz  = 0;
+        this->records    = 0;
+    }
+
+    std::string buf(st.st_size > off_t(this->loaded_sz) ? st.st_size - this->loaded_sz : 0, '\0');
+
+    for (size_t done = 0; done < buf.size();) {
+        ssize_t n = pread(fd, buf.data() + done, buf.size() - done, this->loaded_sz + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            throw_err("pread()", this->path_cache);
+        }
+
+        done += n;
+    }
+
+    size_t off = 0;
+
+    if (!this->loaded_sz) {
+        struct hash_cache_header hdr = {};
+
+        std::memcpy(&hdr, buf.data(), std::min(buf.size(), sizeof(hdr)));
+
+        // Unknown or broken: ignored, and replaced by the next Flush()
+        if (buf.size() < sizeof(hdr) ||
+            std::memcmp(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != HASH_CACHE_VERSION) {
+            this->garbage = !buf.empty();
+            return;
+        }
+
+        off = sizeof(hdr);
+    }
+
+    for (struct hash_cache_record rec; buf.size() - off >= sizeof(rec);) {
+        std::memcpy(&rec, buf.data() + off, sizeof(rec));
+
+        if (!rec.path_sz || rec.path_sz > PATH_MAX ||
+            buf.size() - off - sizeof(rec) < rec.path_sz) {
+            break;
+        }
+
+        std::string path(buf.data() + off + sizeof(rec), rec.path_sz);
+
+        this->entries[path] = {
+            rec.id,
+            { std::string(rec.sha256, sizeof(rec.sha256)), rec.crc32 },
+        };
+
+        off += sizeof(rec) + rec.path_sz;
+        ++this->records;
+    }
+
+    // A torn tail is left by a job killed while appending
+    this->loaded_sz += off;
+    this->garbage = off != buf.size();
+}
+
+struct file_digest
+HashCache::Digest(const std::string &fname)
+{
+    auto path = std::filesystem::absolute(fname).lexically_normal().string();
+    auto id   = FileId(fname);
+    auto it   = this->entries.find(path);
+
+    if (it != this->entries.end() && it->second.id == id) {
+        return it->second.digest;
+    }
+
+    auto digest = file_digest_read(fname);
+
+    uint64_t now_ns = FileClockNs();
+
+    // Changed while read, or so recent that a write could keep its ctime: used,
+    // not remembered
+    if (FileId(fname) == id && FileIdSettled(id, now_ns)) {
+        std::lock_guard<std::mutex> lock(this->added_lock);
+        this->added.push_back({ path, { id, digest } });
+    }
+
+    return digest;
+}
+
+void
+HashCache::Flush()
+{
+    if (this->added.empty()) {
+        return;
+    }
+
+    auto path_dir = std::filesystem::path(this->path_cache).parent_path();
+
+    if (!path_dir.empty()) {
+        std::filesystem::create_directories(path_dir);
+    }
+
+    int fd;
+
+    // Locked, then checked: a compaction may have renamed a new file in meanwhile
+    for (;;) {
+        fd = open(this->path_cache.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+
+        if (fd < 0) {
+            throw_err("open()", this->path_cache);
+        }
+
+        struct stat st_fd, st_path;
+
+        if (flock(fd, LOCK_EX)) {
+            close(fd);
+            throw_err("flock()", this->path_cache);
+        }
+
+        if (!fstat(fd, &st_fd) && !stat(this->path_cache.c_str(), &st_path) &&
+            st_fd.st_dev == st_path.st_dev && st_fd.st_ino == st_path.st_ino) {
+            break;
+        }
+
+        close(fd);
+    }
+
+    try {
+        // Records other jobs appended since the load
+        this->Load(fd);
+
+        for (auto &[path, entry] : this->added) {
+            this->entries[path] = entry;
+        }
+
+        struct hash_cache_header hdr = {};
+
+        std::memcpy(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = HASH_CACHE_VERSION;
+
+        bool compact = this->garbage ||
+                       this->records + this->added.size() > 2 * this->entries.size() + 1024;
+
+        std::string buf;
+
+        if (compact || !this->loaded_sz) {
+            buf.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        }
+
+        // Rewritten with live entries only once stale ones dominate. Files that
+        // are gone or changed since are dropped, trees come and go between runs.
+        if (compact) {
+            for (auto it = this->entries.begin(); it != this->entries.end();) {
+                bool live = false;
+
+                try {
+                    live = FileId(it->first) == it->second.id;
+                } catch (const std::exception &) {
+                }
+
+                if (!live) {
+                    it = this->entries.erase(it);
+                    continue;
+                }
+
+                RecordAppend(buf, it->first, it->second.id, it->second.digest);
+                ++it;
+            }
+
+            FileAtomic cache(this->path_cache, buf.size());
+            FileWriteAt(cache.Fd(), buf, 0);
+            cache.Commit();
+
+            // Parsed again from the start by the next Load()
+            this->loaded_ino = 0;
+            this->records    = this->entries.size();
+            this->garbage    = false;
+        } else {
+            for (auto &[path, entry] : this->added) {
+                RecordAppend(buf, path, entry.id, entry.digest);
+            }
+
+            FileWriteAt(fd, buf, this->loaded_sz);
+
+            this->loaded_sz += buf.size();
+            this->records += this->added.size();
+        }
+
+        this->added.clear();
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+std::string
+HashCache::DefaultPath()
+{
+    auto xdg  = std::getenv("XDG_CACHE_HOME");
+    auto home = std::getenv("HOME");
+
+    if (xdg && *xdg) {
+        return std::string(xdg) + "/hwfmw/hash_cache.bin";
+    }
+
+    if (home && *home) {
+        return std::string(home) + "/.cache/hwfmw/hash_cache.bin";
+    }
+
+    return {};
+}
@@ -0,0 +1,63 @@
+#ifndef HASHCACHE_UTIL_H
+#define HASHCACHE_UTIL_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <string_view>
+#include <unordered_map>
+#include "util.hpp"
+
+struct file_digest {
+    std::string sha256; // Hex digest
+    uint32_t crc32;
+};
+
+// SHA-256 and CRC32 of a file, in one read
+struct file_digest file_digest_read(const std::string &fname);
+
+// Digests keyed by (dev, inode, size, mtime_ns, path), kept across runs in one
+// append-only file. Parallel jobs may share it: they load it under a shared flock(),
+// append or compact it under an exclusive one. A changed file no longer matches its
+// key and is hashed again.
+class HashCache {
+
+  private:
+    struct cache_entry {
+        struct file_id id;
+        struct file_digest digest;
+    };
+
+    std::string path_cache;
+    std::unordered_map<std::string, struct cache_entry> entries;
+
+    // File as parsed so far: inode, bytes, records (stale ones too), tail not parsed
+    uint64_t loaded_ino = 0;
+    uint64_t loaded_sz  = 0;
+    size_t records      = 0;
+    bool garbage        = false;
+
+    std::mutex added_lock;
+    std::vector<std::pair<std::string, struct cache_entry>> added;
+
+    void Load(int fd);
+
+  public:
+    explicit HashCache(const std::string &path);
+
+    HashCache(const HashCache &) = delete;
+    HashCache &operator=(const HashCache &) = delete;
+
+    // From the cache while fname is unchanged, otherwise read and queued for
+    // Flush(). Thread safe.
+    struct file_digest Digest(const std::string &fname);
+    // Writes what Digest() queued, once the workers are done
+    void Flush();
+
+    // $XDG_CACHE_HOME/hwfmw/hash_cache.bin or ~/.cache/hwfmw/hash_cache.bin
+    static std::string DefaultPath();
+};
+
+#endif // HASHCACHE_UTIL_H
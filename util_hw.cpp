@@ -1,10 +1,22 @@
+#include <map>
+#include <set>
+#include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iomanip>
 #include <filesystem>
 #include <zlib.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
 #include "util.hpp"
 #include "util_hw.hpp"
+#include "util_crc.hpp"
 #include "util_rsa.hpp"
+#include "util_io.hpp"
+
+// Item files mapped at once by ItemsCRC32(), far below the default vm.max_map_count
+constexpr size_t ITEMS_MAPPED_MAX = 4096;
 
 void
 Firmware::PrintItems(bool flag_verbose)
@@ -17,7 +29,11 @@ Firmware::PrintItems(bool flag_verbose)
         ITEM,
         SECTION,
         VERSION,
-        POLICY
+        POLICY,
+        ZIP_TYPE,
+        ZIP_SIZE,
+        ZIP_CRC32,
+        COLS
     };
 
     struct col_data {
@@ -26,7 +42,7 @@ Firmware::PrintItems(bool flag_verbose)
         const char *name;
     };
 
-    struct col_data cols[8];
+    struct col_data cols[COLS];
     cols[ITEM_ITER]   = { true, 0, "Iter" };
     cols[ITEM_CRC32]  = { true, 0, "Item CRC32" };
     cols[DATA_OFFSET] = { true, 0, "Data offset" };
@@ -35,17 +51,54 @@ Firmware::PrintItems(bool flag_verbose)
     cols[SECTION]     = { false, 0, "Section" };
     cols[VERSION]     = { false, 0, "Version" };
     cols[POLICY]      = { true, 0, "Policy" };
+    cols[ZIP_TYPE]    = { false, 0, "Zip" };
+    cols[ZIP_SIZE]    = { false, 0, "Inflated size" };
+    cols[ZIP_CRC32]   = { false, 0, "Inflated CRC32" };
+
+    // Inflate columns only after an unpack that inflated
+    auto col_shown = [&](size_t j) {
+        return (flag_verbose || !cols[j].verbose) && (j < ZIP_TYPE || !this->items_zip.empty());
+    };
+
+    auto zip_value = [&](size_t i, size_t j) {
+        auto &zi = this->items_zip.at(i);
+        std::ostringstream val;
+
+        if (zi.format == ZIP_NONE) {
+            val << '-';
+        } else if (j == ZIP_TYPE) {
+            val << zip_format_name(zi.format);
+        } else if (!zi.ok) {
+            val << "broken";
+        } else if (j == ZIP_SIZE) {
+            val << zi.sz;
+        } else {
+            val << std::showbase << std::hex << zi.crc32;
+        }
+
+        return val.str();
+    };
 
     std::ostream &os = std::cout;
     os.setf(std::ios::left, std::ios::adjustfield);
 
-    for (auto &hi : this->items_hdr) {
-        for (size_t j = 0; j < 8; ++j) {
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        auto &hi = this->items_hdr.at(i);
+
+        for (size_t j = 0; j < COLS; ++j) {
 
             auto &col = cols[j];
 
             const char *p = nullptr;
 
+            if (j >= ZIP_TYPE) {
+                if (col_shown(j)) {
+                    col.len = std::max(
+                        { col.len, std::strlen(col.name), zip_value(i, j).size() });
+                }
+                continue;
+            }
+
             if (j == ITEM) {
                 p = hi.item;
             } else if (j == SECTION) {
@@ -70,11 +123,11 @@ Firmware::PrintItems(bool flag_verbose)
     {
         size_t b_sz = 1; // First separator '|'
 
-        for (auto &col : cols) {
-            if (!flag_verbose && col.verbose) {
+        for (size_t j = 0; j < COLS; ++j) {
+            if (!col_shown(j)) {
                 continue;
             }
-            b_sz += col.len + 3; // Two spaces ' ' and separator '|'
+            b_sz += cols[j].len + 3; // Two spaces ' ' and separator '|'
         }
         os << std::setfill('-') << std::setw(b_sz) << '-';
         os << std::setfill(' ') << std::endl;
@@ -87,8 +140,8 @@ Firmware::PrintItems(bool flag_verbose)
 
     border_print();
     os << '|';
-    for (size_t i = 0; i < 8; ++i) {
-        if (!flag_verbose && cols[i].verbose) {
+    for (size_t i = 0; i < COLS; ++i) {
+        if (!col_shown(i)) {
             continue;
         }
         column_print(i, cols[i].name);
@@ -96,7 +149,9 @@ Firmware::PrintItems(bool flag_verbose)
     os << std::endl;
     border_print();
 
-    for (auto &hi : this->items_hdr) {
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        auto &hi = this->items_hdr.at(i);
+
         os << '|';
 
         if (flag_verbose) {
@@ -117,46 +172,124 @@ Firmware::PrintItems(bool flag_verbose)
         if (flag_verbose) {
             column_print(POLICY, hi.policy);
         }
+
+        for (size_t j = ZIP_TYPE; j < COLS && col_shown(j); ++j) {
+            column_print(j, zip_value(i, j));
+        }
         os << std::endl;
     }
     border_print();
 }
 
+bool
+item_filter::Match(const struct huawei_item &hi) const
+{
+    auto match_any = [](const std::vector<std::string> &patterns, const char *name) {
+        if (patterns.empty()) {
+            return true;
+        }
+
+        for (auto &pattern : patterns) {
+            if (!fnmatch(pattern.c_str(), name, 0)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    return match_any(this->items, hi.item) && match_any(this->sections, hi.section);
+}
+
+bool
+Firmware::ItemSelected(size_t i)
+{
+    return this->filter.Empty() || this->filter.Match(this->items_hdr.at(i));
+}
+
+std::vector<size_t>
+Firmware::ItemsSelected()
+{
+    std::vector<size_t> items_ix;
+
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        if (this->ItemSelected(i)) {
+            items_ix.push_back(i);
+        }
+    }
+
+    return items_ix;
+}
+
+struct crc32_report
+Firmware::VerifyCRC32()
+{
+    struct crc32_report report = {};
+
+    // Normally fused into UnpackToFS, otherwise one pass over the items here.
+    // Items left out by the filter are not read and count as matching.
+    if (this->items_crc32.size() != this->items_src.size()) {
+        this->items_crc32 = this->ItemsCRC32(true);
+    }
+
+    uint32_t items_raw_crc32 = 0;
+    size_t items_raw_sz      = 0, layout_sz = 0;
+
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        auto &hi = this->items_hdr.at(i);
+
+        report.items_ok.push_back(!this->ItemSelected(i) ||
+                                  this->items_crc32.at(i) == hi.item_crc32);
+
+        items_raw_sz += hi.data_sz;
+        items_raw_crc32 =
+            crc32_combine(items_raw_crc32, this->items_crc32.at(i), hi.data_sz);
+    }
+
+    // Stored header bytes are checked as is, so old format needs no second pass
+    report.hdr_ok      = this->HeaderCRC32(HW_OFF::CRC32_HDR) == this->hdr.hdr_crc32;
+    report.raw_checked = this->filter.Empty();
+    report.raw_ok      = report.raw_checked &&
+                         crc32_combine(this->HeaderCRC32(HW_OFF::CRC32_ALL),
+                                       items_raw_crc32,
+                                       items_raw_sz) == this->hdr.raw_crc32;
+
+    layout_sz = sizeof(huawei_header) + this->items_hdr.size() * sizeof(huawei_item) +
+                this->prod_list.size();
+    report.hdr_sz_old = this->hdr.hdr_sz + 36 == layout_sz;
+
+    return report;
+}
+
 void
 Firmware::CheckCRC32()
 {
-    // Backup old CRC32 values
-    decltype(Firmware::hdr) header_old          = this->hdr;
-    decltype(Firmware::items_hdr) items_hdr_old = this->items_hdr;
-
-    this->PackToMem();
-    // Set link to new CRC32 values after packing
-    decltype(Firmware::hdr) &header_new          = this->hdr;
-    decltype(Firmware::items_hdr) &items_hdr_new = this->items_hdr;
+    auto report = this->VerifyCRC32();
 
-    // old format ... -36
-    if (header_old.raw_crc32 != header_new.raw_crc32) {
-        std::cout << "[ * ] Repack CRC32 ..." << std::endl;
-        header_new.hdr_sz -= 36;
-        // Repack CRC32 after change hdr_sz
-        this->CalculateCRC32();
+    if (report.hdr_sz_old) {
+        std::cout << "[ * ] Old format header size (-36)" << std::endl;
     }
 
     // preset format CRC32 print
     std::cout << std::showbase << std::hex;
 
-    std::cout << (header_old.raw_crc32 == header_new.raw_crc32 ? "[ + ] " : "[ - ] ")
-              << "Verify CRC32 Full: " << header_old.raw_crc32 << std::endl;
+    if (report.raw_checked) {
+        std::cout << (report.raw_ok ? "[ + ] " : "[ - ] ")
+                  << "Verify CRC32 Full: " << this->hdr.raw_crc32 << std::endl;
+    } else {
+        std::cout << "[ * ] Verify CRC32 Full: skipped, items filtered" << std::endl;
+    }
 
-    std::cout << (header_old.hdr_crc32 == header_new.hdr_crc32 ? "[ + ] " : "[ - ] ")
-              << "Verify CRC32 Head: " << header_old.hdr_crc32 << std::endl;
+    std::cout << (report.hdr_ok ? "[ + ] " : "[ - ] ")
+              << "Verify CRC32 Head: " << this->hdr.hdr_crc32 << std::endl;
 
-    for (size_t i = 0; i < items_hdr_old.size(); ++i) {
-        auto &hi_old = items_hdr_old.at(i);
-        auto &hi_new = items_hdr_new.at(i);
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        if (!this->ItemSelected(i)) {
+            continue;
+        }
 
-        std::cout << (hi_old.item_crc32 == hi_new.item_crc32 ? "[ + ] " : "[ - ] ")
-                  << "Verify CRC32 Item: " << hi_old.item << std::endl;
+        std::cout << (report.items_ok.at(i) ? "[ + ] " : "[ - ] ")
+                  << "Verify CRC32 Item: " << this->items_hdr.at(i).item << std::endl;
     }
 }
 
@@ -202,7 +335,7 @@ Firmware::PathItemOnFmw(const std::string &raw_path_item)
 }
 
 void
-Firmware::PackToMem()
+Firmware::PresetLayout()
 {
     this->hdr._unknow_data_1 = 0x00;
     this->hdr._unknow_data_2 = 0x00;
@@ -211,30 +344,243 @@ Firmware::PackToMem()
     this->hdr.item_sz     = sizeof(huawei_item);
     this->hdr.item_counts = this->items_hdr.size();
 
-    this->hdr.raw_sz = this->hdr.hdr_sz = sizeof(huawei_header) +
-                                          this->hdr.item_counts * this->hdr.item_sz +
-                                          this->hdr.prod_list_sz;
+    // Offsets and sizes are 32 bit on flash, the product list size is 16 bit
+    if (this->prod_list.size() > UINT16_MAX) {
+        throw_err("Product list over 64 KiB", std::to_string(this->prod_list.size()));
+    }
 
-    for (size_t i = 0; i < this->hdr.item_counts; ++i) {
-        auto &hi  = this->items_hdr.at(i);
-        auto &raw = this->items_raw.at(i);
+    uint64_t raw_sz = sizeof(huawei_header) +
+                      uint64_t(this->hdr.item_counts) * this->hdr.item_sz +
+                      this->hdr.prod_list_sz;
 
-        hi.data_off = this->hdr.raw_sz;
-        hi.data_sz  = raw.size();
+    this->hdr.hdr_sz = raw_sz - (this->hdr_sz_old ? 36 : 0);
 
-        this->hdr.raw_sz += hi.data_sz;
+    for (auto &hi : this->items_hdr) {
+        if (raw_sz + hi.data_sz > UINT32_MAX) {
+            throw_err("Image over 4 GiB", hi.item);
+        }
+
+        hi.data_off = raw_sz;
+        raw_sz += hi.data_sz;
+    }
+
+    this->hdr.raw_sz = raw_sz;
+}
+
+void
+Firmware::PackToMem()
+{
+    for (size_t i = 0; i < this->items_hdr.size(); ++i) {
+        this->items_hdr.at(i).data_sz = this->items_src.at(i).sz;
     }
 
+    this->PresetLayout();
     this->CalculateCRC32();
 
     this->hdr.raw_sz = BSWAP32(this->hdr.raw_sz - HW_OFF::SZ_BIN);
 }
 
+void
+Firmware::PackToFS(const std::string &path_items,
+                   const std::string &path_fmw,
+                   const std::string &path_item_stat)
+{
+    StatScope stat(STAT_PACK);
+
+    auto items_stat_old = this->ReadItemStat(path_item_stat);
+
+    std::vector<std::string> items_path;
+    std::vector<struct item_stat> items_stat;
+
+    // Layout from file sizes, payloads are never held in memory
+    for (auto &hi : this->items_hdr) {
+        auto item_path = FilePathOnFS(path_items, this->PathItemOnFmw(hi.item));
+        auto item_id   = FileId(item_path);
+
+        hi.data_sz = item_id.sz;
+        stat.AddBytes(hi.data_sz);
+
+        items_path.push_back(item_path);
+        items_stat.push_back({ item_id, 0 });
+    }
+
+    this->PresetLayout();
+
+    // Small items are queued per worker, a batch goes out when full or at the end.
+    // Their CRC32 is known once the batch is submitted.
+    std::vector<std::unique_ptr<IoBatch>> batches(
+        ParallelWorkers(this->items_hdr.size(), this->threads));
+
+    auto item_write = [&](size_t i, size_t w, int fd, uint32_t &item_crc32) {
+        auto &hi    = this->items_hdr.at(i);
+        auto it_old = items_stat_old.find(hi.item);
+
+        item_crc32 = 0;
+
+        // Unchanged since the last unpack or pack: no read, no CRC32
+        if (it_old != items_stat_old.end() && it_old->second.id == items_stat.at(i).id) {
+            FileCopyRange(items_path.at(i), fd, hi.data_off, hi.data_sz);
+            item_crc32 = it_old->second.crc32;
+            return;
+        }
+
+        auto crc32_cb = [&item_crc32](std::string_view c) {
+            item_crc32 = crc32_update(item_crc32, c.data(), c.size());
+        };
+
+        if (hi.data_sz > IO_BATCH_FILE_SZ) {
+            FileCopyRange(items_path.at(i), fd, hi.data_off, hi.data_sz, crc32_cb);
+            return;
+        }
+
+        auto &batch = batches.at(w);
+
+        if (!batch) {
+            batch = IoBatchNew();
+        }
+
+        if (batch->Full()) {
+            batch->Submit();
+        }
+
+        batch->CopyRange(items_path.at(i), fd, hi.data_off, hi.data_sz, crc32_cb);
+    };
+
+    this->PackStreamToFS(path_fmw, item_write, [&]() {
+        ParallelFor(batches.size(), this->threads, [&](size_t w) {
+            if (batches.at(w)) {
+                batches.at(w)->Submit();
+            }
+        });
+    });
+
+    for (size_t i = 0; i < items_stat.size(); ++i) {
+        items_stat.at(i).crc32 = this->items_hdr.at(i).item_crc32;
+    }
+
+    this->WriteItemStat(path_item_stat, items_stat);
+}
+
+void
+Firmware::PackStreamToFS(const std::string &path_fmw,
+                         const std::function<void(size_t, size_t, int, uint32_t &)> &item_write,
+                         const std::function<void()> &flush)
+{
+    // raw_sz is still the whole layout here
+    FileAtomic fmw(path_fmw, this->hdr.raw_sz);
+
+    // Items land at disjoint offsets, workers need no coordination
+    ParallelFor(this->items_hdr.size(), this->threads, [&](size_t i, size_t w) {
+        item_write(i, w, fmw.Fd(), this->items_hdr.at(i).item_crc32);
+    });
+
+    if (flush) {
+        flush();
+    }
+
+    this->CombineCRC32();
+    this->hdr.raw_sz = BSWAP32(this->hdr.raw_sz - HW_OFF::SZ_BIN);
+
+    // Header and items table go last, once all CRC32 are known
+    FileWriteVAt(fmw.Fd(), this->HeaderChunks(), 0);
+    fmw.Commit();
+}
+
+std::map<std::string, struct item_stat>
+Firmware::ReadItemStat(const std::string &path_item_stat)
+{
+    std::map<std::string, struct item_stat> items_stat;
+
+    if (!std::filesystem::exists(path_item_stat)) {
+        return items_stat;
+    }
+
+    std::stringstream list_stat;
+    list_stat << FileRead(path_item_stat, std::ios::in);
+
+    for (std::string line; std::getline(list_stat, line);) {
+
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+
+        std::string item;
+        struct item_stat st;
+        std::istringstream i_fmt(line);
+
+        i_fmt >> item >> st.id.sz >> st.id.mtime_ns >> st.id.ctime_ns >> st.id.dev >> st.id.ino;
+        i_fmt >> std::hex >> st.crc32;
+
+        // A broken line only costs a re-read of that item
+        if (i_fmt) {
+            items_stat[item] = st;
+        }
+    }
+
+    return items_stat;
+}
+
+void
+Firmware::WriteItemStat(const std::string &path_item_stat,
+                        const std::vector<struct item_stat> &items_stat)
+{
+    std::fstream list_stat = FileOpen(path_item_stat, std::ios::out);
+
+    list_stat << "# item size mtime_ns ctime_ns dev inode crc32" << '\n';
+
+    // Same item twice: the last line wins, as the last write did
+    for (size_t i = 0; i < items_stat.size(); ++i) {
+        auto &st = items_stat.at(i);
+
+        list_stat << this->items_hdr.at(i).item << ' ' << std::dec << st.id.sz << ' '
+                  << st.id.mtime_ns << ' ' << st.id.ctime_ns << ' ' << st.id.dev << ' '
+                  << st.id.ino << ' '
+                  << std::showbase << std::hex << st.crc32 << std::noshowbase << '\n';
+    }
+}
+
+// Leaves no file behind when the stream turns out to be broken
+static struct zip_info
+ItemInflateToFS(std::string_view raw, enum ZIP_FORMAT format, const std::string &path)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        throw_err("open()", path);
+    }
+
+    struct zip_info info;
+    uint64_t off = 0;
+
+    try {
+        info = zip_inflate(raw, format, [&](std::string_view chunk) {
+            FileWriteAt(fd, chunk, off);
+            off += chunk.size();
+        });
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd)) {
+        throw_err("close()", path);
+    }
+
+    if (!info.ok) {
+        std::filesystem::remove(path);
+    }
+
+    return info;
+}
+
 void
 Firmware::UnpackToFS(const std::string &path_items,
                      const std::string &path_metadata,
-                     const std::string &path_sig_item)
+                     const std::string &path_sig_item,
+                     const std::string &path_item_stat)
 {
+    StatScope stat(STAT_UNPACK);
+
     std::fstream list_sig_item, list_metadata;
 
     if (!std::filesystem::exists(path_items)) {
@@ -252,31 +598,255 @@ Firmware::UnpackToFS(const std::string &path_items,
     list_metadata << std::dec << this->hdr.prod_list_sz << ' ' << this->prod_list.c_str()
                   << std::endl;
 
+    std::vector<std::string> items_path(this->hdr.item_counts);
+    std::set<std::string> items_dir;
+
     for (size_t i = 0; i < this->hdr.item_counts; ++i) {
-        auto &hi  = this->items_hdr.at(i);
-        auto &raw = this->items_raw.at(i);
+        auto &hi = this->items_hdr.at(i);
 
-        auto item_path = FilePathOnFS(path_items, this->PathItemOnFmw(hi.item));
-        auto item_dir  = std::filesystem::path(item_path).parent_path();
+        items_path.at(i) = FilePathOnFS(path_items, this->PathItemOnFmw(hi.item));
 
-        if (!std::filesystem::exists(item_dir)) {
-            std::filesystem::create_directories(item_dir);
+        if (this->ItemSelected(i)) {
+            stat.AddBytes(hi.data_sz);
+            items_dir.insert(std::filesystem::path(items_path.at(i)).parent_path());
         }
 
-        std::fstream item_bin(FileOpen(item_path, std::ios::out | std::ios::binary));
-        item_bin << raw;
-
         list_metadata << "- ";
         list_metadata << hi.iter << ' ' << hi.item << ' ' << hi.section << ' ';
         list_metadata << (*hi.version ? hi.version : "NULL") << ' ' << hi.policy;
-        list_metadata << std::endl;
+        list_metadata << '\n';
+
+        list_sig_item << "- " << hi.item << '\n';
+    }
+
+    // Each directory is created once, before the workers start
+    for (auto &item_dir : items_dir) {
+        std::filesystem::create_directories(item_dir);
+    }
+
+    // Same path twice: only the last item is written, as before
+    std::map<std::string_view, size_t> items_last;
+
+    for (size_t i = 0; i < items_path.size(); ++i) {
+        if (this->ItemSelected(i)) {
+            items_last[items_path.at(i)] = i;
+        }
+    }
+
+    // Header CRC32 does not depend on payloads, reject it before any write
+    if (this->crc32_fail_fast &&
+        this->HeaderCRC32(HW_OFF::CRC32_HDR) != this->hdr.hdr_crc32) {
+        throw_err("CRC32 mismatch", "Header");
+    }
+
+    // Kernel copy needs every payload in the image file, the store hashes them instead
+    bool kernel_copy =
+        this->kernel_copy && !this->store && !this->fmw_path.empty() &&
+        std::all_of(this->items_src.begin(), this->items_src.end(), [](auto &src) {
+            return src.kind == SRC_IMAGE;
+        });
+
+    if (!kernel_copy) {
+        // Item CRC32 is computed on each chunk as it is written out
+        this->items_crc32.assign(items_path.size(), 0);
+    } else if (this->crc32_fail_fast) {
+        // Payloads never reach user space while copied: a read-only pass over the
+        // mapped image first, nothing is written on a mismatch
+        this->items_crc32 = this->ItemsCRC32(true);
+
+        for (size_t i = 0; i < items_path.size(); ++i) {
+            auto &hi = this->items_hdr.at(i);
+
+            if (this->ItemSelected(i) && this->items_crc32.at(i) != hi.item_crc32) {
+                throw_err("CRC32 mismatch", hi.item);
+            }
+        }
+    } else {
+        // The same pass once the items are copied, below
+        this->items_crc32.clear();
+    }
+
+    this->items_zip.assign(this->inflate ? items_path.size() : 0, {});
+
+    // A partial tree gets no manifest, as it gets no sidecar
+    bool manifest = !this->path_manifest.empty() && this->filter.Empty();
+    std::vector<std::string> items_sha256(manifest ? items_path.size() : 0);
+
+    int fd_fmw = -1;
+
+    if (kernel_copy && (fd_fmw = open(this->fmw_path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        throw_err("open()", this->fmw_path);
+    }
+
+    // Small items are queued per worker and written a batch at a time, their
+    // payloads stay mapped until the batch is submitted
+    size_t workers = ParallelWorkers(items_path.size(), this->threads);
+
+    std::vector<std::unique_ptr<IoBatch>> batches(workers);
+    std::vector<std::vector<struct item_payload>> batches_payload(workers);
+
+    auto item_unpack = [&](size_t i, size_t w) {
+        auto &hi = this->items_hdr.at(i);
+
+        if (!this->ItemSelected(i)) {
+            return;
+        }
+
+        struct item_payload payload;
+        bool queued = false;
+
+        if (kernel_copy) {
+            auto &src = this->items_src.at(i);
+
+            if (items_last.at(items_path.at(i)) == i) {
+                FileCloneRange(fd_fmw, src.off, src.sz, items_path.at(i));
+            }
+
+            if (this->inflate || manifest) {
+                payload = this->ItemLoad(i);
+            }
+        } else {
+            auto &item_crc32 = this->items_crc32.at(i);
+
+            auto crc32_cb = [&](std::string_view chunk) {
+                item_crc32 = crc32_update(item_crc32, chunk.data(), chunk.size());
+            };
+
+            payload = this->ItemLoad(i);
+
+            if (items_last.at(items_path.at(i)) != i) {
+                crc32_cb(payload.raw);
+            } else if (this->store) {
+                this->store->Link(payload.raw, items_path.at(i), crc32_cb);
+            } else if (payload.raw.size() <= IO_BATCH_FILE_SZ) {
+                auto &batch = batches.at(w);
+
+                if (!batch) {
+                    batch = IoBatchNew();
+                }
+
+                crc32_cb(payload.raw);
+                batch->WriteFile(items_path.at(i), payload.raw);
+                queued = true;
+            } else {
+                FileWrite(items_path.at(i), payload.raw, crc32_cb);
+            }
+
+            if (this->crc32_fail_fast && item_crc32 != hi.item_crc32) {
+                throw_err("CRC32 mismatch", hi.item);
+            }
+        }
+
+        // Runs on the worker of the item, over the payload still mapped
+        if (manifest && items_last.at(items_path.at(i)) == i) {
+            items_sha256.at(i) = sha256_sum(payload.raw.data(), payload.raw.size());
+        }
+
+        if (this->inflate) {
+            auto format = zip_detect(payload.raw);
+
+            if (items_last.at(items_path.at(i)) != i) {
+                this->items_zip.at(i) = zip_inflate(payload.raw, format);
+            } else if (format != ZIP_NONE) {
+                this->items_zip.at(i) =
+                    ItemInflateToFS(payload.raw, format, items_path.at(i) + ".inflated");
+            }
+        }
+
+        if (queued) {
+            batches_payload.at(w).push_back(std::move(payload));
+
+            if (batches.at(w)->Full()) {
+                batches.at(w)->Submit();
+                batches_payload.at(w).clear();
+            }
+        }
+    };
+
+    try {
+        ParallelFor(items_path.size(), this->threads, item_unpack);
+
+        for (auto &batch : batches) {
+            if (batch) {
+                batch->Submit();
+            }
+        }
+    } catch (...) {
+        if (fd_fmw >= 0) {
+            close(fd_fmw);
+        }
+
+        throw;
+    }
+
+    if (fd_fmw >= 0) {
+        close(fd_fmw);
+    }
+
+    // Sidecar and manifest record what was computed, never the items table.
+    // VerifyCRC32() reuses it.
+    if (this->items_crc32.empty()) {
+        this->items_crc32 = this->ItemsCRC32(true);
+    }
+
+    // A partial tree cannot be repacked, so it gets no sidecar
+    if (!this->filter.Empty()) {
+        return;
+    }
+
+    // Lets the next repack skip items that were not touched
+    std::vector<struct item_stat> items_stat;
+
+    for (size_t i = 0; i < items_path.size(); ++i) {
+        size_t i_last = items_last.at(items_path.at(i));
+
+        items_stat.push_back({ FileId(items_path.at(i)), this->items_crc32.at(i_last) });
+    }
+
+    this->WriteItemStat(path_item_stat, items_stat);
+
+    if (!manifest) {
+        return;
+    }
+
+    // Taken once the ids are: a file changed too close to it is racily clean and
+    // its record is not trusted, as git does with its index
+    uint64_t stat_ns = FileClockNs();
+
+    // Same item twice: both records describe the file the last one wrote
+    std::vector<struct manifest_item> items_manifest(items_path.size());
+
+    for (size_t i = 0; i < items_path.size(); ++i) {
+        auto &rec = items_manifest.at(i);
+        auto &sha = items_sha256.at(items_last.at(items_path.at(i)));
+
+        rec.id    = items_stat.at(i).id;
+        rec.crc32 = items_stat.at(i).crc32;
+        rec.hi    = this->items_hdr.at(i);
 
-        list_sig_item << "- " << hi.item << std::endl;
+        std::memcpy(rec.sha256, sha.data(), sizeof(rec.sha256));
     }
+
+    Manifest::Write(this->path_manifest,
+                    this->hdr.magic_huawei,
+                    stat_ns,
+                    this->prod_list,
+                    items_manifest);
+}
+
+std::vector<std::string_view>
+Firmware::HeaderChunks() const
+{
+    return {
+        { reinterpret_cast<const char *>(&this->hdr), sizeof(huawei_header) },
+        this->prod_list,
+        { reinterpret_cast<const char *>(this->items_hdr.data()),
+          this->items_hdr.size() * sizeof(huawei_item) },
+    };
 }
 
 void
-Firmware::WriteFlashTo(std::ostream &os)
+Firmware::WriteHeaderTo(std::ostream &os)
 {
     if (!os.write(reinterpret_cast<const char *>(&this->hdr), sizeof(huawei_header))) {
         throw_err("!os.write", "Header");
@@ -290,101 +860,345 @@ Firmware::WriteFlashTo(std::ostream &os)
                   this->items_hdr.size() * sizeof(huawei_item))) {
         throw_err("!os.write", "Header Item");
     }
+}
 
-    for (auto &raw : this->items_raw) {
-        if (!os.write(raw.data(), raw.size())) {
+void
+Firmware::WriteFlashTo(std::ostream &os)
+{
+    this->WriteFlashTo([&](std::string_view chunk) {
+        if (!os.write(chunk.data(), chunk.size())) {
             throw_err("!os.write", "Raw Item");
         }
+    });
+}
+
+void
+Firmware::WriteFlashTo(const std::function<void(std::string_view)> &writer)
+{
+    StatScope stat(STAT_WRITE_FLASH);
+
+    std::ostringstream hdr_buf;
+    this->WriteHeaderTo(hdr_buf);
+    writer(hdr_buf.str());
+
+    for (size_t i = 0; i < this->items_src.size(); ++i) {
+        auto payload = this->ItemLoad(i);
+
+        stat.AddBytes(payload.raw.size());
+        writer(payload.raw);
+    }
+}
+
+void
+Firmware::WriteFlashToFS(const std::string &path_fmw)
+{
+    StatScope stat(STAT_WRITE_FLASH);
+
+    FileAtomic fmw(path_fmw, this->FlashSize());
+
+    auto chunks  = this->HeaderChunks();
+    uint64_t off = 0;
+
+    // Items are mapped IOV_MAX at a time, only for their pwritev()
+    std::vector<struct item_payload> payloads;
+
+    for (size_t i = 0;; ++i) {
+        if (i == this->items_src.size() || chunks.size() == IOV_MAX) {
+            FileWriteVAt(fmw.Fd(), chunks, off);
+
+            for (auto &chunk : chunks) {
+                off += chunk.size();
+            }
+
+            chunks.clear();
+            payloads.clear();
+        }
+
+        if (i == this->items_src.size()) {
+            break;
+        }
+
+        payloads.push_back(this->ItemLoad(i));
+        chunks.push_back(payloads.back().raw);
+        stat.AddBytes(payloads.back().raw.size());
+    }
+
+    fmw.Commit();
+}
+
+uint64_t
+Firmware::FlashSize()
+{
+    uint64_t fmw_sz = sizeof(huawei_header) + this->prod_list.size() +
+                      this->items_hdr.size() * sizeof(huawei_item);
+
+    for (auto &src : this->items_src) {
+        fmw_sz += src.sz;
     }
+
+    return fmw_sz;
 }
 
 void
-Firmware::ReadFlashFromFS(const std::string &path_fmw)
+Firmware::Reset()
+{
+    this->hdr = {};
+    this->prod_list.clear();
+    this->items_hdr.clear();
+    this->items_src.clear();
+    this->items_crc32.clear();
+    this->items_zip.clear();
+    this->items_buf.clear();
+    this->fmw_path.clear();
+    this->items_raw.clear();
+    this->items_map.clear();
+    this->fmw_map = FileMap();
+}
+
+void
+Firmware::ParseFlash(std::string_view head, uint64_t fmw_sz, const std::string &name)
 {
-    std::fstream fd = FileOpen(path_fmw, std::ios::in | std::ios::binary);
+    auto contains = [&](uint64_t off, uint64_t sz, uint64_t total_sz) {
+        return off <= total_sz && sz <= total_sz - off;
+    };
+
+    size_t off = 0;
 
-    if (!fd.read(reinterpret_cast<char *>(&this->hdr), sizeof(huawei_header))) {
-        throw_err("Header corrupted", path_fmw);
+    if (!contains(off, sizeof(huawei_header), head.size())) {
+        throw_err("Header corrupted", name);
     }
 
-    this->prod_list.resize(this->hdr.prod_list_sz);
+    std::memcpy(&this->hdr, head.data() + off, sizeof(huawei_header));
+    off += sizeof(huawei_header);
 
-    if (!fd.read(this->prod_list.data(), this->prod_list.size())) {
-        throw_err("Product list corrupted", path_fmw);
+    if (!contains(off, this->hdr.prod_list_sz, head.size())) {
+        throw_err("Product list corrupted", name);
     }
 
+    this->prod_list.assign(head.data() + off, this->hdr.prod_list_sz);
+    off += this->hdr.prod_list_sz;
+
     for (uint32_t i = 0; i < this->hdr.item_counts; ++i) {
         struct huawei_item hi;
 
-        if (!fd.read(reinterpret_cast<char *>(&hi), sizeof(huawei_item))) {
-            throw_err("Items corrupted", path_fmw);
+        if (!contains(off, sizeof(huawei_item), head.size())) {
+            throw_err("Items corrupted", name);
         }
 
+        std::memcpy(&hi, head.data() + off, sizeof(huawei_item));
+        off += sizeof(huawei_item);
+
         this->AddItemHeader(hi);
     }
 
+    // Payloads are only located here, never read
     for (auto &hi : this->items_hdr) {
-        std::string raw(hi.data_sz, '\0');
+        if (!contains(hi.data_off, hi.data_sz, fmw_sz)) {
+            throw_err("Raw Data corrupted", std::to_string(hi.data_off));
+        }
+
+        this->items_src.push_back({ SRC_IMAGE, hi.data_off, hi.data_sz, {}, {} });
+    }
+}
+
+void
+Firmware::ReadFlashFromFS(const std::string &path_fmw)
+{
+    StatScope stat(STAT_READ_FLASH);
+
+    this->Reset();
+
+    uint64_t fmw_sz = std::filesystem::file_size(path_fmw);
+
+    // Header first for the size of the items table, then the table itself
+    struct huawei_header hdr_peek = {};
+    {
+        FileMap hdr_map(path_fmw, 0, std::min<uint64_t>(fmw_sz, sizeof(huawei_header)));
+        std::memcpy(&hdr_peek, hdr_map.data(), hdr_map.size());
+    }
+
+    uint64_t head_sz = sizeof(huawei_header) + hdr_peek.prod_list_sz +
+                       uint64_t(hdr_peek.item_counts) * sizeof(huawei_item);
+
+    FileMap head(path_fmw, 0, std::min(head_sz, fmw_sz));
+    stat.AddBytes(head.size());
+
+    this->ParseFlash({ head.data(), head.size() }, fmw_sz, path_fmw);
+    this->fmw_path = path_fmw;
+}
+
+void
+Firmware::ReadFlashFromMem(std::string_view fmw)
+{
+    StatScope stat(STAT_READ_FLASH, fmw.size());
+
+    this->Reset();
+    this->ParseFlash(fmw, fmw.size(), "Memory");
+
+    for (auto &src : this->items_src) {
+        src = { SRC_MEM, 0, src.sz, {}, fmw.substr(src.off, src.sz) };
+    }
+}
+
+void
+Firmware::PrefetchFlash()
+{
+    this->getFlashMap().Prefetch();
+}
+
+const FileMap &
+Firmware::getFlashMap() const
+{
+    if (!this->fmw_map.data() && !this->fmw_path.empty()) {
+        this->fmw_map = FileMap(this->fmw_path);
+    }
+
+    return this->fmw_map;
+}
+
+const std::vector<std::string_view> &
+Firmware::getItemsRaw() const
+{
+    // Items added since the last call are pinned on top of the others
+    for (size_t i = this->items_raw.size(); i < this->items_src.size(); ++i) {
+        auto &src = this->items_src.at(i);
+
+        if (src.kind == SRC_IMAGE) {
+            this->items_raw.push_back(this->getFlashMap().View(src.off, src.sz));
+        } else if (src.kind == SRC_FILE) {
+            auto &map = this->items_map.emplace_back(this->ItemLoad(i).map);
+            this->items_raw.push_back({ map.data(), map.size() });
+        } else {
+            this->items_raw.push_back(src.mem);
+        }
+    }
+
+    return this->items_raw;
+}
 
-        if (!fd.seekg(hi.data_off)) {
-            throw_err("Offset to data corrupted", std::to_string(hi.data_off));
+struct item_payload
+Firmware::ItemLoad(size_t i) const
+{
+    auto &src = this->items_src.at(i);
+
+    struct item_payload payload;
+
+    if (src.kind == SRC_MEM) {
+        payload.raw = src.mem;
+    } else if (src.kind == SRC_IMAGE && this->fmw_map.data()) {
+        payload.raw = this->fmw_map.View(src.off, src.sz);
+    } else if (src.kind == SRC_IMAGE) {
+        payload.map = FileMap(this->fmw_path, src.off, src.sz);
+    } else {
+        payload.map = FileMap(src.path);
+
+        // Layout was made from the size at add time
+        if (payload.map.size() != src.sz) {
+            throw_err("Item size changed", src.path);
         }
+    }
+
+    if (payload.map.data()) {
+        // Each item is consumed front to back, once
+        payload.map.Advise(MADV_SEQUENTIAL);
+        payload.raw = { payload.map.data(), payload.map.size() };
+    }
+
+    return payload;
+}
+
+std::vector<uint32_t>
+Firmware::ItemsCRC32(bool selected_only)
+{
+    size_t items_sz = this->items_src.size();
+    bool image_items =
+        std::any_of(this->items_src.begin(), this->items_src.end(), [](auto &src) {
+            return src.kind == SRC_IMAGE;
+        });
+
+    // Image items are views into one mapping, unmapped on return as the rest.
+    // Item files take a mapping each: vm.max_map_count caps how many live at once.
+    FileMap image;
+
+    if (image_items && !this->fmw_map.data()) {
+        image = FileMap(this->fmw_path);
+    }
+
+    std::vector<uint32_t> items_crc32(items_sz, 0);
+
+    for (size_t first = 0; first < items_sz; first += ITEMS_MAPPED_MAX) {
+        size_t window = std::min(items_sz - first, ITEMS_MAPPED_MAX);
+
+        std::vector<struct item_payload> payloads(window);
+        std::vector<std::string_view> items_raw(window);
+
+        for (size_t i = first; i < first + window; ++i) {
+            auto &src = this->items_src.at(i);
+
+            if (selected_only && !this->ItemSelected(i)) {
+                continue;
+            }
 
-        if (!fd.read(raw.data(), raw.size())) {
-            throw_err("Raw Data corrupted", path_fmw);
+            if (src.kind == SRC_IMAGE && image.data()) {
+                items_raw.at(i - first) = image.View(src.off, src.sz);
+            } else {
+                payloads.at(i - first)  = this->ItemLoad(i);
+                items_raw.at(i - first) = payloads.at(i - first).raw;
+            }
         }
 
-        this->AddItemRaw(raw);
+        auto window_crc32 = crc32_parallel(items_raw, this->threads);
+
+        std::copy(window_crc32.begin(), window_crc32.end(), items_crc32.begin() + first);
     }
+
+    return items_crc32;
 }
 
 void
 Firmware::CalculateCRC32()
 {
-    uint32_t prod_list_crc32 = 0, prod_list_sz = 0;
-    uint32_t items_hdr_crc32 = 0, items_hdr_sz = 0;
-    uint32_t items_raw_crc32 = 0, items_raw_sz = 0;
-
-    prod_list_sz = this->prod_list.size();
-    prod_list_crc32 =
-        crc32(0, reinterpret_cast<uint8_t *>(this->prod_list.data()), prod_list_sz);
+    auto items_crc32 = this->ItemsCRC32(false);
 
     for (size_t i = 0; i < this->hdr.item_counts; ++i) {
-        auto &hi  = this->items_hdr.at(i);
-        auto &raw = this->items_raw.at(i);
+        this->items_hdr.at(i).item_crc32 = items_crc32.at(i);
+    }
+
+    this->CombineCRC32();
+}
+
+uint32_t
+Firmware::HeaderCRC32(size_t off)
+{
+    uint32_t hdr_crc32;
 
-        hi.item_crc32 = crc32(0, reinterpret_cast<uint8_t *>(raw.data()), raw.size());
+    hdr_crc32 = crc32_update(0,
+                             reinterpret_cast<uint8_t *>(&this->hdr) + off,
+                             sizeof(huawei_header) - off);
+    hdr_crc32 = crc32_update(hdr_crc32, this->prod_list.data(), this->prod_list.size());
+    hdr_crc32 = crc32_update(hdr_crc32,
+                             this->items_hdr.data(),
+                             this->items_hdr.size() * sizeof(huawei_item));
 
-        items_hdr_sz += sizeof(huawei_item);
-        items_hdr_crc32 =
-            crc32(items_hdr_crc32, reinterpret_cast<uint8_t *>(&hi), sizeof(huawei_item));
+    return hdr_crc32;
+}
+
+void
+Firmware::CombineCRC32()
+{
+    uint32_t items_raw_crc32 = 0, items_raw_sz = 0;
 
+    for (auto &hi : this->items_hdr) {
         items_raw_sz += hi.data_sz;
         items_raw_crc32 = crc32_combine(items_raw_crc32, hi.item_crc32, hi.data_sz);
     }
 
-    uint32_t hdr_crc32, raw_crc32;
-
     // Calculate header crc32
-    hdr_crc32 = crc32(0,
-                      reinterpret_cast<uint8_t *>(&hdr) + HW_OFF::CRC32_HDR,
-                      sizeof(huawei_header) - HW_OFF::CRC32_HDR);
-    hdr_crc32 = crc32_combine(hdr_crc32, prod_list_crc32, prod_list_sz);
-    hdr_crc32 = crc32_combine(hdr_crc32, items_hdr_crc32, items_hdr_sz);
-
-    // Set
-    this->hdr.hdr_crc32 = hdr_crc32;
+    this->hdr.hdr_crc32 = this->HeaderCRC32(HW_OFF::CRC32_HDR);
 
     // Calculate full crc32 after get hdr.hdr_crc32
-    raw_crc32 = crc32(0,
-                      reinterpret_cast<uint8_t *>(&hdr) + HW_OFF::CRC32_ALL,
-                      sizeof(huawei_header) - HW_OFF::CRC32_ALL);
-    raw_crc32 = crc32_combine(raw_crc32, prod_list_crc32, prod_list_sz);
-    raw_crc32 = crc32_combine(raw_crc32, items_hdr_crc32, items_hdr_sz);
-    raw_crc32 = crc32_combine(raw_crc32, items_raw_crc32, items_raw_sz);
-
-    // Set
-    this->hdr.raw_crc32 = raw_crc32;
+    this->hdr.raw_crc32 = crc32_combine(
+        this->HeaderCRC32(HW_OFF::CRC32_ALL), items_raw_crc32, items_raw_sz);
 }
 
 void
@@ -414,8 +1228,41 @@ Firmware::ReadHeaderFromFS(std::stringstream &fd)
     }
 }
 
-bool
-Firmware::CryptoVerify(const std::string &sig_file, const std::string &key_pub)
+void
+Firmware::ReadManifestFromFS(const std::string &path_manifest,
+                             const std::vector<struct huawei_item> &items_sel)
+{
+    Manifest manifest(path_manifest);
+
+    this->hdr.magic_huawei = manifest.Header().magic_huawei;
+    this->prod_list        = manifest.ProdList();
+    this->hdr.prod_list_sz = this->prod_list.size();
+
+    // Records by (iter, item) as item_list.txt names them
+    std::map<std::pair<uint32_t, std::string_view>, size_t> records;
+
+    for (size_t i = 0; i < manifest.size(); ++i) {
+        auto &hi = manifest.at(i).hi;
+        std::string_view item(hi.item, strnlen(hi.item, sizeof(hi.item)));
+
+        records.emplace(std::make_pair(hi.iter, item), i);
+    }
+
+    this->items_hdr.reserve(items_sel.size());
+
+    for (auto &hi : items_sel) {
+        auto it = records.find({ hi.iter, hi.item });
+
+        if (it == records.end()) {
+            throw_err("Item not in item_list.bin", hi.item);
+        }
+
+        this->items_hdr.push_back(manifest.at(it->second).hi);
+    }
+}
+
+struct rsa_sig_pair
+Firmware::CryptoSplit(const std::string &sig_file)
 {
     constexpr uint32_t sig_sz = 256; // hw sig size
     if (sig_file.size() <= sig_sz) {
@@ -426,19 +1273,19 @@ Firmware::CryptoVerify(const std::string &sig_file, const std::string &key_pub)
     auto sig_data =
         reinterpret_cast<const uint8_t *>(&sig_file[sig_file.size() - sig_sz]);
 
-    return RSA_verify_data(key_pub, raw_data, sig_file.size() - sig_sz, sig_data, sig_sz);
+    return { raw_data, sig_file.size() - sig_sz, sig_data, sig_sz };
 }
 
-std::string
-Firmware::CryptoSign(const std::string &raw_data, const std::string &key_priv)
+bool
+Firmware::CryptoVerify(const std::string &sig_file, RSAKeyring &key_pub)
 {
-    std::string sig_buf;
-
-    if (!RSA_sign_data(raw_data, key_priv, sig_buf)) {
-        throw_err("!RSA_sign_data()", "Sign error");
-    }
+    return key_pub.Verify(this->CryptoSplit(sig_file));
+}
 
-    return sig_buf;
+std::string
+Firmware::CryptoSign(const std::string &raw_data, RSAKeyring &key_priv)
+{
+    return key_priv.Sign(raw_data.data(), raw_data.size());
 }
 
 void
@@ -448,9 +1295,8 @@ Firmware::ReadItemFromFS(const std::string &path_items)
 
         auto item_path = FilePathOnFS(path_items, this->PathItemOnFmw(hi.item));
 
-        std::string &&raw = FileRead(item_path, std::ios::in | std::ios::binary);
-
-        this->items_raw.push_back(std::move(raw));
+        // Only the size is taken now, the file is mapped when a method reads it
+        this->items_src.push_back({ SRC_FILE, 0, FileId(item_path).sz, item_path, {} });
     }
 }
 
@@ -459,10 +1305,32 @@ Firmware::AddItemHeader(struct huawei_item &hi)
 {
     this->items_hdr.push_back(hi);
 }
+void
+Firmware::ReplaceItemRaw(size_t i, std::string &raw)
+{
+    if (i >= this->items_src.size()) {
+        throw_err("Item out of range", std::to_string(i));
+    }
+
+    // Frees the payload of an earlier replace
+    auto &buf             = this->items_buf[i] = std::move(raw);
+    this->items_src.at(i) = { SRC_MEM, 0, buf.size(), {}, buf };
+
+    // Pinned views follow the new payload
+    if (i < this->items_raw.size()) {
+        this->items_raw.at(i) = buf;
+    }
+
+    // CRC32 of the payload as read no longer applies
+    this->items_crc32.clear();
+}
+
 void
 Firmware::AddItemRaw(std::string &raw)
 {
-    this->items_raw.push_back(std::move(raw));
+    // Map nodes stay in place, so views of other items stay valid
+    auto &buf = this->items_buf[this->items_src.size()] = std::move(raw);
+    this->items_src.push_back({ SRC_MEM, 0, buf.size(), {}, buf });
 }
 
 void
@@ -1,55 +1,246 @@
 #ifndef HW_CTL_H
 #define HW_CTL_H
 
+#include <map>
+#include <deque>
 #include <vector>
+#include <optional>
 #include <iostream>
+#include <string_view>
+#include "util.hpp"
+#include "util_rsa.hpp"
+#include "util_store.hpp"
+#include "util_zip.hpp"
+#include "util_manifest.hpp"
 #include "huawei_header.h"
 
+struct crc32_report {
+    bool raw_ok;
+    bool raw_checked; // False when a filter left items unread
+    bool hdr_ok;
+    bool hdr_sz_old; // Old format: hdr_sz is 36 less than the layout
+    std::vector<bool> items_ok;
+};
+
+// Items kept by a selective unpack: exact names or fnmatch() globs, any of
+// the item patterns and any of the section patterns. Empty lists match all.
+struct item_filter {
+    std::vector<std::string> items;
+    std::vector<std::string> sections;
+
+    bool
+    Empty() const
+    {
+        return this->items.empty() && this->sections.empty();
+    }
+
+    bool Match(const struct huawei_item &hi) const;
+};
+
+// Where the payload of an item is read from, only when a method needs it
+enum ITEM_SRC { SRC_IMAGE, SRC_FILE, SRC_MEM };
+
+struct item_source {
+    enum ITEM_SRC kind;
+    uint64_t off; // SRC_IMAGE: offset in the image
+    uint64_t sz;
+    std::string path;      // SRC_FILE
+    std::string_view mem;  // SRC_MEM
+};
+
+// Payload of one item while a method uses it, unmapped when it goes away
+struct item_payload {
+    FileMap map;
+    std::string_view raw;
+};
+
+// Sidecar record of an item file, lets repack skip unchanged items
+struct item_stat {
+    struct file_id id;
+    uint32_t crc32;
+};
+
 class Firmware {
 
   private:
     struct huawei_header hdr;
     std::string prod_list;
     std::vector<struct huawei_item> items_hdr;
-    std::vector<std::string> items_raw;
+    std::vector<struct item_source> items_src;
+
+    // Image of SRC_IMAGE items, and owned buffers of SRC_MEM items by item index
+    std::string fmw_path;
+    std::map<size_t, std::string> items_buf;
+
+    // Pinned by getFlashMap() and getItemsRaw(), kept until the next Reset()
+    mutable FileMap fmw_map;
+    mutable std::deque<FileMap> items_map;
+    mutable std::vector<std::string_view> items_raw;
+
+    // CRC32 of the payloads as read, filled while unpacking
+    std::vector<uint32_t> items_crc32;
+
+    // Worker threads for CRC32 and unpack (0 - all cores)
+    size_t threads = 0;
+    bool crc32_fail_fast = false;
+
+    // Old format images store hdr_sz 36 bytes short of the layout
+    bool hdr_sz_old = false;
+
+    // Unpack links items from a content-addressed store when set
+    std::optional<ItemStore> store;
+
+    // Selective unpack, payloads of other items are never touched
+    struct item_filter filter;
+
+    // Unpack also writes compressed items inflated, next to them as .inflated
+    bool inflate = false;
+    std::vector<struct zip_info> items_zip;
+
+    // Unpack copies item ranges file to file in the kernel, CRC32 is a separate pass
+    bool kernel_copy = false;
+
+    // Unpack also writes the binary manifest here, with SHA-256 of every item
+    std::string path_manifest;
+
+    void ParseFlash(std::string_view head, uint64_t fmw_sz, const std::string &name);
+    std::vector<uint32_t> ItemsCRC32(bool selected_only);
 
   public:
+    void
+    SetThreads(size_t n)
+    {
+        this->threads = n;
+    }
+
+    void
+    SetCRC32FailFast(bool fail_fast)
+    {
+        this->crc32_fail_fast = fail_fast;
+    }
+
+    void
+    SetHeaderSizeOld(bool old_format)
+    {
+        this->hdr_sz_old = old_format;
+    }
+
+    void
+    SetItemFilter(const struct item_filter &item_filter)
+    {
+        this->filter = item_filter;
+    }
+
+    void
+    SetInflate(bool inflate_items)
+    {
+        this->inflate = inflate_items;
+    }
+
+    void
+    SetKernelCopy(bool copy_in_kernel)
+    {
+        this->kernel_copy = copy_in_kernel;
+    }
+
+    void
+    SetManifest(const std::string &path)
+    {
+        this->path_manifest = path;
+    }
+
+    void
+    SetItemStore(const std::string &path_store)
+    {
+        this->store.emplace(path_store);
+    }
+
     auto &
     getItemsHeader()
     {
         return this->items_hdr;
     }
 
-    auto &
-    getItemsRaw()
+    const auto &
+    getItemsHeader() const
     {
-        return this->items_raw;
+        return this->items_hdr;
     }
 
+    uint64_t
+    ItemSize(size_t i) const
+    {
+        return this->items_src.at(i).sz;
+    }
+
+    // Maps every payload at once and keeps it mapped, for callers that need
+    // all items side by side. Methods below load one item at a time instead.
+    const std::vector<std::string_view> &getItemsRaw() const;
+    const FileMap &getFlashMap() const;
+    struct item_payload ItemLoad(size_t i) const;
+
+    void Reset();
     void PresetItemHeader(struct huawei_item &hi, const std::string &line);
     void AddItemRaw(std::string &raw);
+    void ReplaceItemRaw(size_t i, std::string &raw);
     void AddItemHeader(struct huawei_item &hi);
     void ReadItemFromFS(const std::string &path_items);
     std::string PathItemOnFmw(const std::string &raw_path_item);
 
+    void PresetLayout();
     void PackToMem();
+    void PackToFS(const std::string &path_items,
+                  const std::string &path_fmw,
+                  const std::string &path_item_stat);
+    // Lays out nothing: call PresetLayout() first. item_write(i, w, fd, crc32)
+    // writes item i at its data_off and sets crc32, a slot that outlives the call.
+    // Items run in parallel and w is the worker, for per-worker state. flush()
+    // runs once all items are written, for writes the workers left queued.
+    void PackStreamToFS(const std::string &path_fmw,
+                        const std::function<void(size_t, size_t, int, uint32_t &)> &item_write,
+                        const std::function<void()> &flush = nullptr);
     void UnpackToFS(const std::string &path_items,
                     const std::string &path_metadata,
-                    const std::string &path_sig_item);
+                    const std::string &path_sig_item,
+                    const std::string &path_item_stat);
+
+    std::map<std::string, struct item_stat> ReadItemStat(const std::string &path_item_stat);
+    void WriteItemStat(const std::string &path_item_stat,
+                       const std::vector<struct item_stat> &items_stat);
 
+    // Header, product list and items table as they go on flash, views into this
+    std::vector<std::string_view> HeaderChunks() const;
+    void WriteHeaderTo(std::ostream &os);
     void WriteFlashTo(std::ostream &os);
+    void WriteFlashTo(const std::function<void(std::string_view)> &writer);
+    // Preallocated temp file filled by pwritev() and renamed over path_fmw
+    void WriteFlashToFS(const std::string &path_fmw);
+    uint64_t FlashSize();
+    // Reads the header and items table only, payloads stay on disk
     void ReadFlashFromFS(const std::string &path_fmw);
+    // Items are views into fmw, it must outlive them
+    void ReadFlashFromMem(std::string_view fmw);
+    void PrefetchFlash();
+    bool ItemSelected(size_t i);
+    std::vector<size_t> ItemsSelected();
 
     void PrintHeader();
     void PrintItems(bool flag_verbose);
 
+    uint32_t HeaderCRC32(size_t off);
+    struct crc32_report VerifyCRC32();
     void CheckCRC32();
     void CalculateCRC32();
+    void CombineCRC32();
 
     void ReadHeaderFromFS(std::stringstream &fd);
+    // Header of item_list.bin and its table entry of each item picked in item_list.txt
+    void ReadManifestFromFS(const std::string &path_manifest,
+                            const std::vector<struct huawei_item> &items_sel);
 
-    bool CryptoVerify(const std::string &sig_file, const std::string &key_pub);
-    std::string CryptoSign(const std::string &raw_data, const std::string &key_priv);
+    struct rsa_sig_pair CryptoSplit(const std::string &sig_file);
+    bool CryptoVerify(const std::string &sig_file, RSAKeyring &key_pub);
+    std::string CryptoSign(const std::string &raw_data, RSAKeyring &key_priv);
 };
 
 #endif // HW_CTL_H
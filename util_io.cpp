@@ -0,0 +1,544 @@
+#include <atomic>
+#include <cerrno>
+#include <vector>
+#include <climits>
+#include <cstring>
+#include <optional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "util.hpp"
+#include "util_io.hpp"
+
+// Files in flight per batch, each one a chain of up to 4 SQEs on its own
+// direct descriptor slot
+constexpr unsigned IO_BATCH_FILES = 64;
+
+// Registered buffer CopyRange() reads land in
+constexpr size_t IO_BATCH_ARENA_SZ = 16 * IO_BATCH_FILE_SZ;
+
+class IoSync final : public IoBatch {
+
+  public:
+    bool
+    Full() const override
+    {
+        return false;
+    }
+
+    void
+    WriteFile(const std::string &path, std::string_view data) override
+    {
+        FileWrite(path, data);
+    }
+
+    void
+    CopyRange(const std::string &path,
+              int fd_out,
+              uint64_t off_out,
+              uint64_t sz,
+              const std::function<void(std::string_view)> &chunk_cb) override
+    {
+        FileCopyRange(path, fd_out, off_out, sz, chunk_cb);
+    }
+
+    void
+    Submit() override
+    {
+    }
+};
+
+// Raw syscalls on the io_uring ABI, no liburing. Every file of a batch is a
+// linked chain: open into a direct descriptor, read/write on it, close it.
+class IoUring final : public IoBatch {
+
+  private:
+    enum IO_STEP { STEP_OPEN, STEP_READ, STEP_WRITE, STEP_CLOSE, STEP_MAX };
+
+    struct io_op {
+        std::string path;
+        std::function<void(std::string_view)> chunk_cb;
+        const char *buf;
+        uint32_t len;
+        unsigned steps; // Bit per IO_STEP queued
+        int res[STEP_MAX];
+    };
+
+    int ring_fd = -1;
+    bool broken = false;
+
+    void *ring_map = MAP_FAILED;
+    size_t ring_map_sz = 0;
+    void *sqes_map = MAP_FAILED;
+    size_t sqes_map_sz = 0;
+    char *arena = static_cast<char *>(MAP_FAILED);
+    size_t arena_used = 0;
+    bool arena_off = false;
+
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    // Reserved up front: the kernel reads path.c_str() of queued opens
+    std::vector<struct io_op> ops;
+    unsigned sqes_queued = 0;
+
+    void Release();
+    bool ArenaMap();
+    void Push(struct io_uring_sqe sqe, enum IO_STEP step);
+    size_t OpBegin(const std::string &path, const char *buf, uint32_t len, int open_flags);
+
+  public:
+    IoUring();
+    ~IoUring() override;
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    bool Full() const override;
+    void WriteFile(const std::string &path, std::string_view data) override;
+    void CopyRange(const std::string &path,
+                   int fd_out,
+                   uint64_t off_out,
+                   uint64_t sz,
+                   const std::function<void(std::string_view)> &chunk_cb) override;
+    void Submit() override;
+};
+
+IoUring::IoUring()
+{
+    struct io_uring_params p = {};
+
+    this->ring_fd = syscall(__NR_io_uring_setup, IO_BATCH_FILES * STEP_MAX, &p);
+
+    if (this->ring_fd < 0) {
+        throw_err("io_uring_setup()", "IoBatch");
+    }
+
+    try {
+        // LINKED_FILE (5.18): a slot opened earlier in the chain is looked up when
+        // the next request runs, not when it is submitted
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_LINKED_FILE)) {
+            errno = ENOSYS;
+            throw_err("io_uring features", "IoBatch");
+        }
+
+        this->ring_map_sz = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                                     p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        this->ring_map    = mmap(nullptr,
+                              this->ring_map_sz,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              this->ring_fd,
+                              IORING_OFF_SQ_RING);
+
+        if (this->ring_map == MAP_FAILED) {
+            throw_err("mmap()", "SQ/CQ ring");
+        }
+
+        this->sqes_map_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+        this->sqes_map    = mmap(nullptr,
+                              this->sqes_map_sz,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              this->ring_fd,
+                              IORING_OFF_SQES);
+
+        if (this->sqes_map == MAP_FAILED) {
+            throw_err("mmap()", "SQEs");
+        }
+
+        auto ring = static_cast<char *>(this->ring_map);
+
+        this->sq_tail  = reinterpret_cast<unsigned *>(ring + p.sq_off.tail);
+        this->sq_mask  = reinterpret_cast<unsigned *>(ring + p.sq_off.ring_mask);
+        this->sq_array = reinterpret_cast<unsigned *>(ring + p.sq_off.array);
+        this->cq_head  = reinterpret_cast<unsigned *>(ring + p.cq_off.head);
+        this->cq_tail  = reinterpret_cast<unsigned *>(ring + p.cq_off.tail);
+        this->cq_mask  = reinterpret_cast<unsigned *>(ring + p.cq_off.ring_mask);
+        this->cqes     = reinterpret_cast<struct io_uring_cqe *>(ring + p.cq_off.cqes);
+        this->sqes     = static_cast<struct io_uring_sqe *>(this->sqes_map);
+
+        // Sparse table, slot i belongs to the i-th file of the batch
+        std::vector<int> fds(IO_BATCH_FILES, -1);
+
+        if (syscall(__NR_io_uring_register,
+                    this->ring_fd,
+                    IORING_REGISTER_FILES,
+                    fds.data(),
+                    fds.size()) < 0) {
+            throw_err("io_uring_register()", "Files");
+        }
+
+        this->ops.reserve(IO_BATCH_FILES);
+    } catch (...) {
+        this->Release();
+        throw;
+    }
+}
+
+IoUring::~IoUring()
+{
+    this->Release();
+}
+
+void
+IoUring::Release()
+{
+    // Ring first: registered files and buffers go with it
+    if (this->ring_fd >= 0) {
+        close(this->ring_fd);
+    }
+
+    if (this->ring_map != MAP_FAILED) {
+        munmap(this->ring_map, this->ring_map_sz);
+    }
+
+    if (this->sqes_map != MAP_FAILED) {
+        munmap(this->sqes_map, this->sqes_map_sz);
+    }
+
+    if (this->arena != MAP_FAILED) {
+        munmap(this->arena, IO_BATCH_ARENA_SZ);
+    }
+}
+
+bool
+IoUring::ArenaMap()
+{
+    if (this->arena != MAP_FAILED || this->arena_off) {
+        return !this->arena_off;
+    }
+
+    // Pinned on the first CopyRange(), a batch that only writes files never pays
+    // for it. Locked memory may be short: the copies then run synchronously.
+    this->arena = static_cast<char *>(mmap(nullptr,
+                                           IO_BATCH_ARENA_SZ,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS,
+                                           -1,
+                                           0));
+
+    struct iovec iov = { this->arena, IO_BATCH_ARENA_SZ };
+
+    if (this->arena == MAP_FAILED ||
+        syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        this->arena_off = true;
+    }
+
+    return !this->arena_off;
+}
+
+bool
+IoUring::Full() const
+{
+    return this->ops.size() == IO_BATCH_FILES ||
+           this->arena_used + IO_BATCH_FILE_SZ > IO_BATCH_ARENA_SZ;
+}
+
+void
+IoUring::Push(struct io_uring_sqe sqe, enum IO_STEP step)
+{
+    // Only this thread moves the tail, the kernel reads it at io_uring_enter()
+    unsigned tail = *this->sq_tail;
+    unsigned idx  = tail & *this->sq_mask;
+
+    sqe.user_data = (this->ops.size() - 1) * STEP_MAX + step;
+
+    this->sqes[idx]     = sqe;
+    this->sq_array[idx] = idx;
+    this->ops.back().steps |= 1u << step;
+
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++this->sqes_queued;
+}
+
+size_t
+IoUring::OpBegin(const std::string &path, const char *buf, uint32_t len, int open_flags)
+{
+    if (this->broken || this->Full()) {
+        throw_err(this->broken ? "io_uring failed before" : "IoBatch full", path);
+    }
+
+    this->ops.push_back({ path, nullptr, buf, len, 0, {} });
+
+    size_t slot = this->ops.size() - 1;
+
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_OPENAT;
+    sqe.flags               = IOSQE_IO_LINK;
+    sqe.fd                  = AT_FDCWD;
+    sqe.addr                = reinterpret_cast<uintptr_t>(this->ops.back().path.c_str());
+    sqe.len                 = 0666;
+    sqe.open_flags          = open_flags; // No O_CLOEXEC, direct descriptors refuse it
+    sqe.file_index          = slot + 1;
+
+    this->Push(sqe, STEP_OPEN);
+
+    return slot;
+}
+
+void
+IoUring::WriteFile(const std::string &path, std::string_view data)
+{
+    if (data.size() > UINT32_MAX) {
+        throw_err("File too large for IoBatch", path);
+    }
+
+    size_t slot = this->OpBegin(path, data.data(), data.size(), O_WRONLY | O_CREAT | O_TRUNC);
+
+    // Hard links: the close runs even when the write fails
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_WRITE;
+    sqe.flags               = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe.fd                  = slot;
+    sqe.addr                = reinterpret_cast<uintptr_t>(data.data());
+    sqe.len                 = data.size();
+    sqe.off                 = 0;
+
+    this->Push(sqe, STEP_WRITE);
+
+    sqe            = {};
+    sqe.opcode     = IORING_OP_CLOSE;
+    sqe.file_index = slot + 1;
+
+    this->Push(sqe, STEP_CLOSE);
+}
+
+void
+IoUring::CopyRange(const std::string &path,
+                   int fd_out,
+                   uint64_t off_out,
+                   uint64_t sz,
+                   const std::function<void(std::string_view)> &chunk_cb)
+{
+    if (sz > IO_BATCH_FILE_SZ) {
+        throw_err("File too large for IoBatch", path);
+    }
+
+    if (!this->ArenaMap()) {
+        FileCopyRange(path, fd_out, off_out, sz, chunk_cb);
+        return;
+    }
+
+    char *buf   = this->arena + this->arena_used;
+    size_t slot = this->OpBegin(path, buf, sz, O_RDONLY);
+
+    this->ops.back().chunk_cb = chunk_cb;
+    this->arena_used += sz;
+
+    struct io_uring_sqe sqe = {};
+    sqe.opcode              = IORING_OP_READ_FIXED;
+    sqe.flags               = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe.fd                  = slot;
+    sqe.addr                = reinterpret_cast<uintptr_t>(buf);
+    sqe.len                 = sz;
+    sqe.off                 = 0;
+    sqe.buf_index           = 0;
+
+    this->Push(sqe, STEP_READ);
+
+    sqe           = {};
+    sqe.opcode    = IORING_OP_WRITE_FIXED;
+    sqe.flags     = IOSQE_IO_HARDLINK;
+    sqe.fd        = fd_out;
+    sqe.addr      = reinterpret_cast<uintptr_t>(buf);
+    sqe.len       = sz;
+    sqe.off       = off_out;
+    sqe.buf_index = 0;
+
+    this->Push(sqe, STEP_WRITE);
+
+    sqe            = {};
+    sqe.opcode     = IORING_OP_CLOSE;
+    sqe.file_index = slot + 1;
+
+    this->Push(sqe, STEP_CLOSE);
+}
+
+void
+IoUring::Submit()
+{
+    if (!this->sqes_queued) {
+        return;
+    }
+
+    uint64_t write_sz = 0, copy_sz = 0;
+
+    for (auto &op : this->ops) {
+        (op.steps & (1u << STEP_READ) ? copy_sz : write_sz) += op.len;
+    }
+
+    std::optional<StatScope> stat_write, stat_copy;
+
+    if (write_sz) {
+        stat_write.emplace(STAT_FILE_WRITE, write_sz);
+    }
+
+    if (copy_sz) {
+        stat_copy.emplace(STAT_FILE_COPY, copy_sz);
+    }
+
+    unsigned submitted = 0, completed = 0;
+    int err_enter      = 0;
+
+    while (submitted < this->sqes_queued) {
+        long n = syscall(
+            __NR_io_uring_enter, this->ring_fd, this->sqes_queued - submitted, 0, 0, nullptr, 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            err_enter = n < 0 ? errno : EIO;
+            break;
+        }
+
+        submitted += n;
+    }
+
+    // Everything submitted is reaped before returning, its buffers are in use till then
+    while (completed < submitted) {
+        unsigned head = *this->cq_head;
+        unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            long n = syscall(__NR_io_uring_enter,
+                             this->ring_fd,
+                             0,
+                             1,
+                             IORING_ENTER_GETEVENTS,
+                             nullptr,
+                             0);
+
+            if (n < 0 && errno != EINTR) {
+                err_enter = errno;
+                break;
+            }
+            continue;
+        }
+
+        for (; head != tail; ++head) {
+            auto &cqe = this->cqes[head & *this->cq_mask];
+            auto &op  = this->ops.at(cqe.user_data / STEP_MAX);
+
+            op.res[cqe.user_data % STEP_MAX] = cqe.res;
+            ++completed;
+        }
+
+        __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    auto ops = std::move(this->ops);
+
+    this->ops.clear();
+    this->ops.reserve(IO_BATCH_FILES);
+    this->arena_used  = 0;
+    this->sqes_queued = 0;
+
+    if (err_enter) {
+        this->broken = true;
+        errno        = err_enter;
+        throw_err("io_uring_enter()", "IoBatch");
+    }
+
+    static const char *step_names[STEP_MAX] = { "open()", "read()", "write()", "close()" };
+
+    // The first cause, not the -ECANCELED of the requests linked after it
+    for (auto &op : ops) {
+        for (int step = 0; step < STEP_MAX; ++step) {
+            int res = op.res[step];
+
+            if (!(op.steps & (1u << step)) || res == -ECANCELED) {
+                continue;
+            }
+
+            bool rw = step == STEP_READ || step == STEP_WRITE;
+
+            if (res < 0 || (rw && uint32_t(res) != op.len)) {
+                errno = res < 0 ? -res : EIO;
+                throw_err(step_names[step], op.path);
+            }
+        }
+    }
+
+    for (auto &op : ops) {
+        if (op.chunk_cb) {
+            op.chunk_cb({ op.buf, op.len });
+        }
+    }
+}
+
+static std::atomic<int> io_backend_active = -1;
+
+const char *
+io_backend_name(enum IO_BACKEND backend)
+{
+    switch (backend) {
+        case IO_SYNC:
+            return "sync";
+        case IO_URING:
+            return "io_uring";
+        default:
+            return "unknown";
+    }
+}
+
+bool
+io_backend_supported(enum IO_BACKEND backend)
+{
+    // Probed once: seccomp or an old kernel fails the same way every time
+    static const bool uring_ok = []() {
+        try {
+            IoUring probe;
+            return true;
+        } catch (const std::exception &) {
+            return false;
+        }
+    }();
+
+    return backend == IO_SYNC || (backend == IO_URING && uring_ok);
+}
+
+enum IO_BACKEND
+io_backend_get()
+{
+    int backend = io_backend_active.load(std::memory_order_relaxed);
+
+    if (backend < 0) {
+        backend = io_backend_supported(IO_URING) ? IO_URING : IO_SYNC;
+        io_backend_active.store(backend, std::memory_order_relaxed);
+    }
+
+    return static_cast<enum IO_BACKEND>(backend);
+}
+
+void
+io_backend_set(enum IO_BACKEND backend)
+{
+    if (!io_backend_supported(backend)) {
+        throw_err("!io_backend_supported()", io_backend_name(backend));
+    }
+
+    io_backend_active.store(backend, std::memory_order_relaxed);
+}
+
+std::unique_ptr<IoBatch>
+IoBatchNew()
+{
+    if (io_backend_get() == IO_URING) {
+        try {
+            return std::make_unique<IoUring>();
+        } catch (const std::exception &) {
+            // Out of locked memory or ring fds, the sync path still works
+        }
+    }
+
+    return std::make_unique<IoSync>();
+}
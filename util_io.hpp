@@ -0,0 +1,52 @@
+#ifndef IO_UTIL_H
+#define IO_UTIL_H
+
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+// Files up to this size go through IoBatch: their cost is syscall round trips,
+// larger ones are bandwidth bound and keep the chunked path
+constexpr size_t IO_BATCH_FILE_SZ = 64 << 10;
+
+enum IO_BACKEND { IO_SYNC, IO_URING, IO_BACKEND_MAX };
+
+const char *io_backend_name(enum IO_BACKEND backend);
+bool io_backend_supported(enum IO_BACKEND backend);
+
+// io_uring when the kernel has it (5.18+, not blocked by seccomp), io_backend_set()
+// overrides it. The sync backend is the plain syscalls, one call at a time.
+enum IO_BACKEND io_backend_get();
+void io_backend_set(enum IO_BACKEND backend);
+
+// Small file operations queued and run together at Submit(): one io_uring_enter()
+// for the whole batch instead of open/read/write/close per file. Buffers and fds
+// passed in must stay valid until Submit() returns. One thread at a time.
+class IoBatch {
+
+  public:
+    virtual ~IoBatch() = default;
+
+    // Submit() before queueing more
+    virtual bool Full() const = 0;
+
+    // path created or truncated, data written, closed
+    virtual void WriteFile(const std::string &path, std::string_view data) = 0;
+    // sz bytes of path written to fd_out at off_out, sz up to IO_BATCH_FILE_SZ.
+    // chunk_cb sees the bytes, as with FileCopyRange(), by the time Submit() returns.
+    virtual void CopyRange(const std::string &path,
+                           int fd_out,
+                           uint64_t off_out,
+                           uint64_t sz,
+                           const std::function<void(std::string_view)> &chunk_cb) = 0;
+
+    // Waits for every queued operation, throws the first error
+    virtual void Submit() = 0;
+};
+
+// Backend of io_backend_get(), falls back to sync if the ring cannot be set up
+std::unique_ptr<IoBatch> IoBatchNew();
+
+#endif // IO_UTIL_H
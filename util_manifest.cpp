@@ -0,0 +1,99 @@
+#include <cstring>
+#include "util.hpp"
+#include "util_manifest.hpp"
+
+Manifest::Manifest(const std::string &path_manifest)
+    : map(path_manifest)
+{
+    if (this->map.size() < sizeof(manifest_header)) {
+        throw_err("Manifest too short", path_manifest);
+    }
+
+    this->hdr   = reinterpret_cast<const struct manifest_header *>(this->map.data());
+    this->items = reinterpret_cast<const struct manifest_item *>(this->hdr + 1);
+
+    if (std::memcmp(this->hdr->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC))) {
+        throw_err("Not a manifest", path_manifest);
+    }
+
+    if (this->hdr->version != MANIFEST_VERSION || this->hdr->item_sz != sizeof(manifest_item)) {
+        throw_err("Unsupported manifest version", std::to_string(this->hdr->version));
+    }
+
+    if (this->hdr->prod_list_sz > UINT16_MAX) {
+        throw_err("Product list over 64 KiB", std::to_string(this->hdr->prod_list_sz));
+    }
+
+    uint64_t manifest_sz = sizeof(manifest_header) +
+                           uint64_t(this->hdr->item_counts) * sizeof(manifest_item) +
+                           this->hdr->prod_list_sz;
+
+    if (this->map.size() != manifest_sz) {
+        throw_err("Manifest size mismatch", path_manifest);
+    }
+}
+
+std::string_view
+Manifest::ProdList() const
+{
+    return this->map.View(this->map.size() - this->hdr->prod_list_sz, this->hdr->prod_list_sz);
+}
+
+bool
+Manifest::Unchanged(size_t i, const std::string &item_path) const
+{
+    auto &id = this->items[i].id;
+
+    // A write in the same timestamp tick as the stat at unpack keeps the id: a file
+    // changed within FILE_ID_SETTLE_NS of stat_ns is racily clean
+    return FileIdSettled(id, this->hdr->stat_ns) && FileId(item_path) == id;
+}
+
+void
+Manifest::Refresh(const std::string &path_manifest,
+                  const std::vector<struct file_id> &ids,
+                  uint64_t stat_ns) const
+{
+    std::vector<struct manifest_item> items(this->items, this->items + this->size());
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        auto &id = items.at(i).id;
+
+        if (ids.at(i).ino) {
+            id = ids.at(i);
+        } else if (!FileIdSettled(id, this->hdr->stat_ns)) {
+            id = {};
+        }
+    }
+
+    Write(path_manifest, this->hdr->magic_huawei, stat_ns, this->ProdList(), items);
+}
+
+void
+Manifest::Write(const std::string &path_manifest,
+                uint32_t magic_huawei,
+                uint64_t stat_ns,
+                std::string_view prod_list,
+                const std::vector<struct manifest_item> &items)
+{
+    struct manifest_header hdr = {};
+
+    std::memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+    hdr.version      = MANIFEST_VERSION;
+    hdr.item_sz      = sizeof(manifest_item);
+    hdr.item_counts  = items.size();
+    hdr.magic_huawei = magic_huawei;
+    hdr.prod_list_sz = prod_list.size();
+    hdr.stat_ns      = stat_ns;
+
+    std::vector<std::string_view> chunks = {
+        { reinterpret_cast<const char *>(&hdr), sizeof(hdr) },
+        { reinterpret_cast<const char *>(items.data()), items.size() * sizeof(manifest_item) },
+        prod_list,
+    };
+
+    FileAtomic manifest(path_manifest, sizeof(hdr) + chunks.at(1).size() + prod_list.size());
+
+    FileWriteVAt(manifest.Fd(), chunks, 0);
+    manifest.Commit();
+}
@@ -0,0 +1,87 @@
+#ifndef MANIFEST_UTIL_H
+#define MANIFEST_UTIL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+#include "util.hpp"
+#include "huawei_header.h"
+
+constexpr char MANIFEST_MAGIC[8]    = "HWMANIF";
+constexpr uint32_t MANIFEST_VERSION = 3;
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t item_sz; // sizeof(manifest_item) of the writer
+    uint32_t item_counts;
+    uint32_t magic_huawei;
+    uint32_t prod_list_sz;
+    uint32_t reserved;
+    uint64_t stat_ns; // Clock once the item ids were taken
+};
+
+// One unpacked item: its table entry as in the image and the file it became
+struct manifest_item {
+    struct file_id id;
+    char sha256[64]; // Hex digest, no NUL
+    uint32_t crc32;
+    uint32_t reserved;
+    struct huawei_item hi;
+};
+
+static_assert(sizeof(manifest_header) == 40 && sizeof(manifest_item) == 472,
+              "Manifest layout is part of the format");
+
+// item_list.bin: manifest_header, item_counts records, product list. Native byte
+// order, read in place through a mapping. item_list.txt stays the editable form.
+// A record vouches for its file only if the file had settled by stat_ns,
+// a racily clean one is hashed again.
+class Manifest {
+
+  private:
+    FileMap map;
+    const struct manifest_header *hdr = nullptr;
+    const struct manifest_item *items = nullptr;
+
+  public:
+    explicit Manifest(const std::string &path_manifest);
+
+    const struct manifest_header &
+    Header() const
+    {
+        return *this->hdr;
+    }
+
+    size_t
+    size() const
+    {
+        return this->hdr->item_counts;
+    }
+
+    const struct manifest_item &
+    at(size_t i) const
+    {
+        return this->items[i];
+    }
+
+    std::string_view ProdList() const;
+
+    // The file still holds what record i describes
+    bool Unchanged(size_t i, const std::string &item_path) const;
+
+    // Rewritten at stat_ns: a record with a non-zero id in ids takes it, one still
+    // racily clean is smudged to a zero id so it is never trusted
+    void Refresh(const std::string &path_manifest,
+                 const std::vector<struct file_id> &ids,
+                 uint64_t stat_ns) const;
+
+    static void Write(const std::string &path_manifest,
+                      uint32_t magic_huawei,
+                      uint64_t stat_ns,
+                      std::string_view prod_list,
+                      const std::vector<struct manifest_item> &items);
+};
+
+#endif // MANIFEST_UTIL_H
@@ -1,95 +1,257 @@
 #include "util.hpp"
 #include "util_rsa.hpp"
+#include <fcntl.h>
 #include <openssl/pem.h>
 
+Sha256::Sha256()
+    : ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free)
+{
+    if (!this->ctx.get()) {
+        throw_err("!EVP_MD_CTX_new()", "sha256");
+    }
+
+    this->Init();
+}
+
+void
+Sha256::Init()
+{
+    // EVP picks up SHA-NI / AVX2 implementations at runtime
+    if (!EVP_DigestInit_ex(this->ctx.get(), EVP_sha256(), nullptr)) {
+        throw_err("!EVP_DigestInit_ex()", "sha256");
+    }
+}
+
+void
+Sha256::Update(const void *raw, size_t raw_sz)
+{
+    StatScope stat(STAT_SHA256, raw_sz);
+
+    if (!EVP_DigestUpdate(this->ctx.get(), raw, raw_sz)) {
+        throw_err("!EVP_DigestUpdate()", "sha256");
+    }
+}
+
 std::string
-sha256_sum(void *raw, size_t raw_sz)
+Sha256::Final()
 {
     uint8_t hash_raw[SHA256_DIGEST_LENGTH];
     std::string hash_str(sizeof(hash_raw) * 2, '\0');
 
-    SHA256(static_cast<uint8_t *>(raw), raw_sz, hash_raw);
+    if (!EVP_DigestFinal_ex(this->ctx.get(), hash_raw, nullptr)) {
+        throw_err("!EVP_DigestFinal_ex()", "sha256");
+    }
 
     for (size_t i = 0; i < sizeof(hash_raw); ++i) {
         std::sprintf(&hash_str[i * 2], "%02hhx", hash_raw[i]);
     }
+
+    this->Init();
+
     return hash_str;
 }
 
-ptr_rsa
-PEM_read(enum RSA_KEY type_key, const std::string &key)
+std::string
+sha256_sum(const void *raw, size_t raw_sz)
+{
+    Sha256 sha256;
+    sha256.Update(raw, raw_sz);
+
+    return sha256.Final();
+}
+
+std::string
+sha256_file(const std::string &fname, const std::function<void(std::string_view)> &chunk_cb)
+{
+    // One chunk per thread is reused across files
+    thread_local std::string buf(IO_CHUNK_SZ, '\0');
+
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        throw_err("open()", fname);
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Sha256 sha256;
+
+    try {
+        for (uint64_t off = 0, n; (n = FileReadAt(fd, buf.data(), buf.size(), off)); off += n) {
+            sha256.Update(buf.data(), n);
+
+            if (chunk_cb) {
+                chunk_cb(std::string_view(buf.data(), n));
+            }
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+
+    return sha256.Final();
+}
+
+static bool
+pkey_ctx_verify(EVP_PKEY_CTX *ctx, const struct rsa_sig_pair &pair)
+{
+    StatScope stat(STAT_RSA_VERIFY, pair.data_sz);
+
+    uint8_t hash_raw[SHA256_DIGEST_LENGTH];
+
+    if (!EVP_Digest(pair.data, pair.data_sz, hash_raw, nullptr, EVP_sha256(), nullptr)) {
+        throw_err("!EVP_Digest()", "sha256");
+    }
+
+    return EVP_PKEY_verify(ctx, pair.sig, pair.sig_sz, hash_raw, sizeof(hash_raw)) == 1;
+}
+
+RSAKeyring::RSAKeyring(enum RSA_KEY type_key, const std::string &key_pem)
+    : type(type_key)
+    , key(nullptr, EVP_PKEY_free)
+    , ctx(nullptr, EVP_PKEY_CTX_free)
 {
-    ptr_bio bio(BIO_new_mem_buf(key.data(), key.size()), BIO_free);
+    ptr_bio bio(BIO_new_mem_buf(key_pem.data(), key_pem.size()), BIO_free);
 
     if (!bio.get()) {
         throw_err("!BIO_new_mem_buf()", "BIO mem");
     }
 
-    RSA *(*rsa_read_cb)(BIO *, RSA **, pem_password_cb *, void *) = nullptr;
-
     if (type_key == RSA_KEY::PRIVATE) {
-        rsa_read_cb = PEM_read_bio_RSAPrivateKey;
+        this->key.reset(PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr));
     } else {
-        rsa_read_cb = PEM_read_bio_RSA_PUBKEY;
+        this->key.reset(PEM_read_bio_PUBKEY(bio.get(), nullptr, nullptr, nullptr));
     }
 
-    ptr_rsa rsa_key(rsa_read_cb(bio.get(), nullptr, nullptr, nullptr), RSA_free);
-
-    if (!rsa_key.get()) {
+    if (!this->key.get() || EVP_PKEY_base_id(this->key.get()) != EVP_PKEY_RSA) {
         if (type_key == RSA_KEY::PRIVATE) {
-            throw_err("!PEM_read_bio_RSAPrivateKey()", "Get Private key");
+            throw_err("!PEM_read_bio_PrivateKey()", "Get Private key");
         } else {
-            throw_err("!PEM_read_bio_RSA_PUBKEY()", "Get Public key");
+            throw_err("!PEM_read_bio_PUBKEY()", "Get Public key");
         }
     }
 
-    return rsa_key;
+    this->ctx.reset(EVP_PKEY_CTX_new(this->key.get(), nullptr));
+
+    if (!this->ctx.get()) {
+        throw_err("!EVP_PKEY_CTX_new()", "RSA key");
+    }
+
+    int ret = type_key == RSA_KEY::PRIVATE ? EVP_PKEY_sign_init(this->ctx.get())
+                                           : EVP_PKEY_verify_init(this->ctx.get());
+
+    // Same scheme as RSA_sign/RSA_verify with NID_sha256
+    if (ret != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(this->ctx.get(), RSA_PKCS1_PADDING) != 1 ||
+        EVP_PKEY_CTX_set_signature_md(this->ctx.get(), EVP_sha256()) != 1) {
+        throw_err("EVP_PKEY_CTX init", "RSA key");
+    }
 }
 
-bool
-RSA_verify_data(const std::string &key_pub,
-                const uint8_t *raw_data,
-                int raw_data_sz,
-                const uint8_t *sig_data,
-                int sig_data_sz)
+std::string
+RSAKeyring::Sign(const void *raw, size_t raw_sz)
 {
-    auto rsa_key = PEM_read(RSA_KEY::PUBLIC, key_pub);
+    if (this->type != RSA_KEY::PRIVATE) {
+        throw_err("Sign with public key", "RSA key");
+    }
 
-    uint8_t sha256_raw[SHA256_DIGEST_LENGTH];
-    SHA256(raw_data, raw_data_sz, sha256_raw);
+    StatScope stat(STAT_RSA_SIGN, raw_sz);
 
-    if (RSA_verify(NID_sha256,
-                   sha256_raw,
-                   sizeof(sha256_raw),
-                   sig_data,
-                   sig_data_sz,
-                   rsa_key.get()) != 1) {
-        return false;
+    uint8_t hash_raw[SHA256_DIGEST_LENGTH];
+
+    if (!EVP_Digest(raw, raw_sz, hash_raw, nullptr, EVP_sha256(), nullptr)) {
+        throw_err("!EVP_Digest()", "sha256");
+    }
+
+    std::string sig_buf(EVP_PKEY_size(this->key.get()), '\0');
+    size_t sig_len = sig_buf.size();
+
+    if (EVP_PKEY_sign(this->ctx.get(),
+                      reinterpret_cast<uint8_t *>(sig_buf.data()),
+                      &sig_len,
+                      hash_raw,
+                      sizeof(hash_raw)) != 1) {
+        throw_err("!EVP_PKEY_sign()", "Sign error");
     }
-    return true;
+
+    return sig_buf;
 }
 
 bool
-RSA_sign_data(const std::string &sig_data,
-              const std::string &key_priv,
-              std::string &sig_buf)
+RSAKeyring::Verify(const struct rsa_sig_pair &pair)
 {
-    auto rsa_key    = PEM_read(RSA_KEY::PRIVATE, key_priv);
-    auto rsa_key_sz = RSA_size(rsa_key.get());
+    if (this->type != RSA_KEY::PUBLIC) {
+        throw_err("Verify with private key", "RSA key");
+    }
 
-    sig_buf.resize(rsa_key_sz);
-    uint32_t sig_len = 0;
+    return pkey_ctx_verify(this->ctx.get(), pair);
+}
 
-    uint8_t hash_raw[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<const uint8_t *>(sig_data.data()), sig_data.size(), hash_raw);
+std::vector<bool>
+RSAKeyring::VerifyBatch(const std::vector<struct rsa_sig_pair> &pairs, size_t threads)
+{
+    if (this->type != RSA_KEY::PUBLIC) {
+        throw_err("Verify with private key", "RSA key");
+    }
 
-    if (RSA_sign(NID_sha256,
-                 hash_raw,
-                 sizeof(hash_raw),
-                 reinterpret_cast<uint8_t *>(sig_buf.data()),
-                 &sig_len,
-                 rsa_key.get()) != 1) {
-        return false;
+    std::vector<ptr_pkey_ctx> ctxs;
+
+    for (size_t i = 0; i < ParallelWorkers(pairs.size(), threads); ++i) {
+        ctxs.emplace_back(EVP_PKEY_CTX_dup(this->ctx.get()), EVP_PKEY_CTX_free);
+
+        if (!ctxs.back().get()) {
+            throw_err("!EVP_PKEY_CTX_dup()", "RSA key");
+        }
+    }
+
+    // std::vector<bool> is packed, workers must not share its words
+    std::vector<uint8_t> verified(pairs.size(), 0);
+
+    ParallelFor(pairs.size(), threads, [&](size_t i, size_t w) {
+        verified.at(i) = pkey_ctx_verify(ctxs.at(w).get(), pairs.at(i));
+    });
+
+    return std::vector<bool>(verified.begin(), verified.end());
+}
+
+std::pair<std::string, std::string>
+RSA_generate_pem(int bits)
+{
+    ptr_pkey_ctx ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), EVP_PKEY_CTX_free);
+
+    if (!ctx.get() || EVP_PKEY_keygen_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), bits) != 1) {
+        throw_err("EVP_PKEY_CTX init", "RSA keygen");
     }
-    return true;
+
+    EVP_PKEY *pkey_raw = nullptr;
+
+    if (EVP_PKEY_keygen(ctx.get(), &pkey_raw) != 1) {
+        throw_err("!EVP_PKEY_keygen()", "RSA keygen");
+    }
+
+    ptr_pkey pkey(pkey_raw, EVP_PKEY_free);
+    ptr_bio bio_priv(BIO_new(BIO_s_mem()), BIO_free);
+    ptr_bio bio_pub(BIO_new(BIO_s_mem()), BIO_free);
+
+    if (!bio_priv.get() || !bio_pub.get()) {
+        throw_err("!BIO_new()", "BIO mem");
+    }
+
+    if (!PEM_write_bio_PrivateKey(bio_priv.get(), pkey.get(), nullptr, nullptr, 0, nullptr,
+                                  nullptr) ||
+        !PEM_write_bio_PUBKEY(bio_pub.get(), pkey.get())) {
+        throw_err("!PEM_write_bio()", "RSA keygen");
+    }
+
+    auto bio_str = [](BIO *bio) {
+        char *data;
+        long sz = BIO_get_mem_data(bio, &data);
+
+        return std::string(data, sz);
+    };
+
+    return { bio_str(bio_priv.get()), bio_str(bio_pub.get()) };
 }
@@ -3,26 +3,67 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <string_view>
 #include <openssl/sha.h>
 #include <openssl/rsa.h>
+#include <openssl/evp.h>
 
 enum RSA_KEY { PRIVATE, PUBLIC };
 
-using ptr_bio = std::unique_ptr<BIO, decltype(&BIO_free)>;
-using ptr_rsa = std::unique_ptr<RSA, decltype(&RSA_free)>;
+using ptr_bio      = std::unique_ptr<BIO, decltype(&BIO_free)>;
+using ptr_pkey     = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+using ptr_pkey_ctx = std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)>;
+using ptr_md_ctx   = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
 
-std::string sha256_sum(void *raw, size_t raw_sz);
+// Incremental SHA-256, Final() returns the hex digest and resets the context
+class Sha256 {
 
-ptr_rsa PEM_read(enum RSA_KEY type_key, const std::string &key_in);
+  private:
+    ptr_md_ctx ctx;
 
-bool RSA_sign_data(const std::string &sig_data,
-                   const std::string &key_priv,
-                   std::string &sig_out);
+  public:
+    Sha256();
 
-bool RSA_verify_data(const std::string &key_pub,
-                     const uint8_t *raw_data,
-                     int sig_data_sz,
-                     const uint8_t *sig_data,
-                     int sig_hash_sz);
+    void Init();
+    void Update(const void *raw, size_t raw_sz);
+    std::string Final();
+};
+
+std::string sha256_sum(const void *raw, size_t raw_sz);
+// chunk_cb sees the file as it is read, for other digests in the same pass
+std::string sha256_file(const std::string &fname,
+                        const std::function<void(std::string_view)> &chunk_cb = nullptr);
+
+struct rsa_sig_pair {
+    const uint8_t *data;
+    size_t data_sz;
+    const uint8_t *sig;
+    size_t sig_sz;
+};
+
+// RSA key parsed once, SHA-256 + PKCS#1 v1.5 sign/verify through EVP_PKEY.
+// Sign/Verify reuse one EVP_PKEY_CTX and are not thread safe,
+// VerifyBatch gives each worker its own copy of it.
+class RSAKeyring {
+
+  private:
+    enum RSA_KEY type;
+    ptr_pkey key;
+    ptr_pkey_ctx ctx;
+
+  public:
+    RSAKeyring(enum RSA_KEY type_key, const std::string &key_pem);
+
+    std::string Sign(const void *raw, size_t raw_sz);
+    bool Verify(const struct rsa_sig_pair &pair);
+    std::vector<bool> VerifyBatch(const std::vector<struct rsa_sig_pair> &pairs,
+                                  size_t threads);
+};
+
+// New key pair as PEM strings: { private, public }
+std::pair<std::string, std::string> RSA_generate_pem(int bits);
 
 #endif // RSA_UTIL_H
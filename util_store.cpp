@@ -0,0 +1,164 @@
+#include <cerrno>
+#include <filesystem>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "util.hpp"
+#include "util_rsa.hpp"
+#include "util_store.hpp"
+
+ItemStore::ItemStore(const std::string &path)
+    : path_store(path)
+{
+    std::filesystem::create_directories(this->path_store);
+}
+
+std::string
+ItemStore::BlobPath(const std::string &sha256, size_t sz)
+{
+    auto path_dir = FilePathOnFS(this->path_store, sha256.substr(0, 2));
+
+    return FilePathOnFS(path_dir, sha256 + '-' + std::to_string(sz));
+}
+
+void
+ItemStore::Link(std::string_view raw,
+                const std::string &path_item,
+                const std::function<void(std::string_view)> &chunk_cb)
+{
+    Sha256 sha256;
+
+    for (size_t off = 0; off < raw.size(); off += IO_CHUNK_SZ) {
+        auto chunk = raw.substr(off, IO_CHUNK_SZ);
+
+        sha256.Update(chunk.data(), chunk.size());
+
+        if (chunk_cb) {
+            chunk_cb(chunk);
+        }
+    }
+
+    auto path_blob = this->BlobPath(sha256.Final(), raw.size());
+
+    struct stat st_blob, st_item;
+
+    if (stat(path_blob.c_str(), &st_blob)) {
+        std::filesystem::create_directories(
+            std::filesystem::path(path_blob).parent_path());
+
+        auto path_tmp = FileTempPath(path_blob);
+
+        FileWrite(path_tmp, raw);
+
+        // A writable blob could be changed through any tree hardlinked to it
+        if (chmod(path_tmp.c_str(), 0444)) {
+            unlink(path_tmp.c_str());
+            throw_err("chmod()", path_tmp);
+        }
+
+        // Another worker may have stored the same blob meanwhile, both are equal
+        if (link(path_tmp.c_str(), path_blob.c_str()) && errno != EEXIST) {
+            unlink(path_tmp.c_str());
+            throw_err("link()", path_blob);
+        }
+
+        unlink(path_tmp.c_str());
+
+        if (stat(path_blob.c_str(), &st_blob)) {
+            throw_err("stat()", path_blob);
+        }
+    }
+
+    // Already linked by a previous unpack
+    if (!stat(path_item.c_str(), &st_item) && st_item.st_dev == st_blob.st_dev &&
+        st_item.st_ino == st_blob.st_ino) {
+        return;
+    }
+
+    if (this->reflink && this->Clone(path_blob, path_item)) {
+        return;
+    }
+
+    if (unlink(path_item.c_str()) && errno != ENOENT) {
+        throw_err("unlink()", path_item);
+    }
+
+    if (link(path_blob.c_str(), path_item.c_str())) {
+        if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            throw_err("link()", path_item);
+        }
+
+        // Store on another filesystem or out of links: plain copy
+        errno = 0;
+        FileWrite(path_item, raw);
+    }
+}
+
+bool
+ItemStore::Clone(const std::string &path_blob, const std::string &path_item)
+{
+    int fd_blob = open(path_blob.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd_blob < 0) {
+        throw_err("open()", path_blob);
+    }
+
+    auto path_tmp = FileTempPath(path_item);
+    int fd = open(path_tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+    if (fd < 0) {
+        close(fd_blob);
+        throw_err("open()", path_tmp);
+    }
+
+    // Extents are shared until either side is written
+    int err = ioctl(fd, FICLONE, fd_blob) ? errno : 0;
+
+    close(fd_blob);
+    close(fd);
+
+    if (!err && !rename(path_tmp.c_str(), path_item.c_str())) {
+        return true;
+    }
+
+    unlink(path_tmp.c_str());
+
+    if (!err) {
+        throw_err("rename()", path_item);
+    }
+
+    // EOPNOTSUPP, EXDEV or EINVAL: the same for every blob, hardlinks from here on
+    this->reflink = false;
+    errno         = 0;
+
+    return false;
+}
+
+struct store_gc
+ItemStore::GC()
+{
+    struct store_gc gc = {};
+
+    for (auto &e : std::filesystem::recursive_directory_iterator(this->path_store)) {
+        struct stat st;
+
+        if (lstat(e.path().c_str(), &st) || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+            continue;
+        }
+
+        // Written by a running unpack, linked as a blob right after
+        if (FileTempName(e.path().string())) {
+            continue;
+        }
+
+        if (unlink(e.path().c_str())) {
+            throw_err("unlink()", e.path().string());
+        }
+
+        gc.blobs += 1;
+        gc.bytes += st.st_size;
+    }
+
+    return gc;
+}
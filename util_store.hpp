@@ -0,0 +1,38 @@
+#ifndef STORE_UTIL_H
+#define STORE_UTIL_H
+
+#include <atomic>
+#include <string>
+#include <functional>
+#include <string_view>
+
+struct store_gc {
+    size_t blobs;
+    uint64_t bytes;
+};
+
+// Content-addressed blobs (SHA-256 + size) linked into unpacked trees. Where the
+// filesystem has reflinks a tree file is a copy-on-write clone, editable in place.
+// Otherwise it is a hardlink to the read-only blob: replace it, do not edit it.
+class ItemStore {
+
+  private:
+    std::string path_store;
+    std::atomic<bool> reflink = true; // Off after the first clone the FS refuses
+
+    bool Clone(const std::string &path_blob, const std::string &path_item);
+
+  public:
+    explicit ItemStore(const std::string &path);
+
+    std::string BlobPath(const std::string &sha256, size_t sz);
+    void Link(std::string_view raw,
+              const std::string &path_item,
+              const std::function<void(std::string_view)> &chunk_cb = nullptr);
+
+    // Removes blobs no tree hardlinks to anymore, and never temp files of a
+    // running unpack. A reflinked tree keeps its data without the blob.
+    struct store_gc GC();
+};
+
+#endif // STORE_UTIL_H
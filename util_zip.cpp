@@ -0,0 +1,125 @@
+#include <string>
+#include <algorithm>
+#include <zlib.h>
+#include "util.hpp"
+#include "util_crc.hpp"
+#include "util_zip.hpp"
+
+enum ZIP_FORMAT
+zip_detect(std::string_view raw)
+{
+    if (raw.size() < 2) {
+        return ZIP_NONE;
+    }
+
+    auto p = reinterpret_cast<const uint8_t *>(raw.data());
+
+    if (raw.size() >= 3 && p[0] == 0x1F && p[1] == 0x8B && p[2] == Z_DEFLATED) {
+        return ZIP_GZIP;
+    }
+
+    // CM 8, window up to 32 KiB, FCHECK, no FDICT: 1 in ~2000 random headers
+    // pass, a false match only costs a failed inflate
+    if ((p[0] & 0x0F) == Z_DEFLATED && (p[0] >> 4) <= 7 && !((p[0] << 8 | p[1]) % 31) &&
+        !(p[1] & 0x20)) {
+        return ZIP_ZLIB;
+    }
+
+    return ZIP_NONE;
+}
+
+const char *
+zip_format_name(enum ZIP_FORMAT format)
+{
+    switch (format) {
+        case ZIP_GZIP:
+            return "gzip";
+        case ZIP_ZLIB:
+            return "zlib";
+        default:
+            return "-";
+    }
+}
+
+struct zip_info
+zip_inflate(std::string_view raw,
+            enum ZIP_FORMAT format,
+            const std::function<void(std::string_view)> &chunk_cb)
+{
+    StatScope stat(STAT_INFLATE);
+
+    struct zip_info info = { format, false, 0, 0 };
+
+    if (format == ZIP_NONE) {
+        return info;
+    }
+
+    z_stream zs = {};
+
+    // 16 + MAX_WBITS: gzip wrapper, MAX_WBITS: zlib wrapper
+    if (inflateInit2(&zs, format == ZIP_GZIP ? 16 + MAX_WBITS : MAX_WBITS) != Z_OK) {
+        throw_err("inflateInit2()", zip_format_name(format));
+    }
+
+    thread_local std::string buf;
+    buf.resize(IO_CHUNK_SZ);
+
+    size_t in_off = 0;
+
+    try {
+        for (;;) {
+            // avail_in is 32 bit, large items are fed in pieces
+            if (!zs.avail_in && in_off < raw.size()) {
+                zs.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(raw.data() + in_off));
+                zs.avail_in = std::min<size_t>(raw.size() - in_off, 1u << 30);
+                in_off += zs.avail_in;
+            }
+
+            zs.next_out  = reinterpret_cast<Bytef *>(buf.data());
+            zs.avail_out = buf.size();
+
+            int rc = inflate(&zs, Z_NO_FLUSH);
+
+            std::string_view chunk(buf.data(), buf.size() - zs.avail_out);
+
+            if (!chunk.empty()) {
+                info.sz += chunk.size();
+                info.crc32 = crc32_update(info.crc32, chunk.data(), chunk.size());
+
+                if (chunk_cb) {
+                    chunk_cb(chunk);
+                }
+            }
+
+            if (rc == Z_MEM_ERROR) {
+                throw_err("inflate()", "Out of memory");
+            }
+
+            if (rc == Z_STREAM_END) {
+                size_t pos = in_off - zs.avail_in;
+
+                // Another member follows, anything else after the end is padding
+                if (format == ZIP_GZIP && raw.substr(pos, 2) == "\x1F\x8B") {
+                    inflateReset(&zs);
+                    continue;
+                }
+
+                info.ok = true;
+                break;
+            }
+
+            // Broken or truncated stream
+            if (rc != Z_OK) {
+                break;
+            }
+        }
+    } catch (...) {
+        inflateEnd(&zs);
+        throw;
+    }
+
+    inflateEnd(&zs);
+    stat.AddBytes(info.sz);
+
+    return info;
+}
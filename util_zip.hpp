@@ -0,0 +1,28 @@
+#ifndef ZIP_UTIL_H
+#define ZIP_UTIL_H
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+enum ZIP_FORMAT { ZIP_NONE, ZIP_GZIP, ZIP_ZLIB };
+
+// Inflated size and CRC32 of a compressed item, ok is false on a broken stream
+struct zip_info {
+    enum ZIP_FORMAT format;
+    bool ok;
+    uint64_t sz;
+    uint32_t crc32;
+};
+
+// By magic: gzip 1f 8b 08, zlib a valid CMF/FLG pair with deflate and no dictionary
+enum ZIP_FORMAT zip_detect(std::string_view raw);
+const char *zip_format_name(enum ZIP_FORMAT format);
+
+// Inflates raw in IO_CHUNK_SZ pieces, chunk_cb sees each one as it comes out.
+// Concatenated gzip members are inflated one after another, as gzip -d does.
+struct zip_info zip_inflate(std::string_view raw,
+                            enum ZIP_FORMAT format,
+                            const std::function<void(std::string_view)> &chunk_cb = nullptr);
+
+#endif // ZIP_UTIL_H